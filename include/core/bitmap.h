@@ -6,7 +6,8 @@ class Bitmap {
 public:
     Bitmap(int height, int width);
 
-    void set_data(std::vector<float3> data);
+    // Copy height x width pixels from any float3 container, such as the color buffer of a GBuffer
+    template <typename Buffer> void set_data(const Buffer &data) { m_data.assign(data.begin(), data.end()); }
 
     [[nodiscard]] int index(int row, int col) const;
 
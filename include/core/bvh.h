@@ -3,37 +3,88 @@
 #include <algorithm>
 #include <core/boundingbox.h>
 #include <core/model.h>
+#include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
-struct BVHNode {
-    BoundingBox bounding_box;             // Bounding box for the node
-    std::vector<int> primitives;          // Primitives in leaf nodes
-    std::shared_ptr<BVHNode> left, right; // Children nodes
-    bool is_leaf;                         // Indicates if the node is a leaf
+// Nodes are stored depth first, the left child of an interior node is the node right after it
+struct LinearBVHNode {
+    float3 min_p;
+    union {
+        int primitive_offset;   // Leaf: first entry in the primitive array
+        int right_child_offset; // Interior: index of the right child
+    };
+    float3 max_p;
+    uint16_t primitive_count; // 0 for interior nodes
+    uint8_t axis;             // Split axis of interior nodes
+    uint8_t pad;
 
-    explicit BVHNode(const BoundingBox &bounding_box_);
+    [[nodiscard]] bool is_leaf() const { return primitive_count > 0; }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+struct BVHStats {
+    int node_count = 0;
+    int leaf_count = 0;
+    int max_depth  = 0;
+    std::vector<int> leaf_histogram; // Leaves with 1, 2, 3-4, 5-8, ... primitives
+    float sah_cost    = 0;           // Expected cost of a query covering the root, relative to one primitive
+    double build_time = 0;           // Milliseconds
+
+    [[nodiscard]] std::string to_string() const;
+};
+
+enum BVHBuildMethod {
+    ESAH,   // Binned surface area heuristic, tighter trees
+    ELinear // Morton code sort with the hierarchy emitted in parallel, much faster to build
 };
 
 class BVHAccel {
 public:
-    explicit BVHAccel(int max_depth_ = 8, int max_primitives_per_leaf_ = 10);
+    // Leaves are chosen by the surface area heuristic, max_depth and max_primitives_per_leaf are hard limits:
+    // nodes at max_depth always become leaves, larger nodes are always split otherwise
+    explicit BVHAccel(int max_depth_ = 64, int max_primitives_per_leaf_ = 32);
 
     void set_model(const std::shared_ptr<Model> &mesh);
 
+    // The linear builder ignores max_depth, its leaves are still collapsed by the surface area heuristic
+    void set_build_method(BVHBuildMethod method);
+
     void construct();
 
     [[nodiscard]] const BoundingBox &get_bounding_box() const;
 
-    std::shared_ptr<BVHNode> root;
+    [[nodiscard]] const BVHStats &get_stats() const;
+
+    // Empty if the model has no faces, otherwise the root is the first node
+    [[nodiscard]] const std::vector<LinearBVHNode> &get_nodes() const;
+
+    // Face ids reordered so that every leaf covers a contiguous range
+    [[nodiscard]] const std::vector<int> &get_primitives() const;
 
 private:
     int max_depth;
     int max_primitives_per_leaf;
+    BVHBuildMethod build_method;
     BoundingBox bounding_box;
+    std::vector<LinearBVHNode> nodes;
     std::vector<int> primitives;
+    std::vector<BoundingBox> primitive_bounds; // Per face, indexed by face id
+    std::vector<float3> centroids;             // Per face, indexed by face id
     std::shared_ptr<Model> model;
+    BVHStats stats;
+
+    // Build BVH recursively over primitives[begin, end), which is partitioned in place
+    void build_tree(int begin, int end, int depth, const BoundingBox &bbox, const BoundingBox &centroid_bbox,
+                    float root_area);
+
+    // Karras 2012 over the Morton order of the face centroids, then refit bottom up
+    void build_linear(const BoundingBox &centroid_bbox, float root_area);
+
+    // Append an interior node whose right child offset is filled in later
+    int make_interior(const BoundingBox &bbox, int axis, float root_area);
 
-    // Build BVH recursively
-    std::shared_ptr<BVHNode> build_tree(std::vector<int> &primitives, int depth);
+    void make_leaf(const BoundingBox &bbox, int begin, int end, int depth, float root_area);
 };
\ No newline at end of file
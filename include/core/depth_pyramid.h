@@ -0,0 +1,38 @@
+#pragma once
+
+#include <core/common.h>
+#include <core/parallel.h>
+#include <vector>
+
+// Max depth mip chain over a width x height depth buffer. Level 0 is the depth buffer itself, texel (x, y) of level l
+// holds the farthest depth of pixels [x * 2^l, (x + 1) * 2^l) x [y * 2^l, (y + 1) * 2^l). Every level lives in one
+// contiguous array, about 1.33 times the size of the depth buffer.
+class DepthPyramid {
+public:
+    DepthPyramid(int width, int height);
+
+    void clear(float value);
+
+    [[nodiscard]] int get_level_count() const;
+
+    [[nodiscard]] int get_level_width(int level) const;
+
+    [[nodiscard]] int get_level_height(int level) const;
+
+    float *data(int level);
+
+    [[nodiscard]] const float *data(int level) const;
+
+    // Conservative max depth of pixels [min_x, max_x] x [min_y, max_y], read from the finest level where the
+    // rectangle spans at most 2 x 2 texels. The rectangle must be inside the buffer.
+    [[nodiscard]] float max_depth(int min_x, int max_x, int min_y, int max_y) const;
+
+    // Propagate level 0 changes inside [min_x, max_x] x [min_y, max_y] up the chain, stops at the first level which
+    // does not change
+    void update(int min_x, int max_x, int min_y, int max_y);
+
+private:
+    FirstTouchVector<float> m_depth;
+    std::vector<int> m_level_offset;
+    std::vector<int2> m_level_size;
+};
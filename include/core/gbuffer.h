@@ -1,6 +1,7 @@
 #pragma once
 
 #include <core/common.h>
+#include <core/parallel.h>
 #include <vector>
 
 class GBuffer {
@@ -9,10 +10,14 @@ public:
 
     [[nodiscard]] int index(int row, int col) const;
 
-    std::vector<float> m_depth_buffer;
-    std::vector<int> m_triangle_id_buffer;
-    std::vector<std::pair<float, float>> m_barycentric_buffer;
-    std::vector<float3> m_normal_buffer;
-    std::vector<float3> m_color_buffer;
+    // Clear every buffer in place for the next frame, rows are cleared in parallel. The constructor leaves the
+    // buffers uninitialized, so this is also their first touch.
+    void reset();
+
+    FirstTouchVector<float> m_depth_buffer;
+    FirstTouchVector<int> m_triangle_id_buffer;
+    FirstTouchVector<std::pair<float, float>> m_barycentric_buffer;
+    FirstTouchVector<float3> m_normal_buffer;
+    FirstTouchVector<float3> m_color_buffer;
     int m_height, m_width;
 };
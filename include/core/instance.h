@@ -0,0 +1,35 @@
+#pragma once
+
+#include <core/model.h>
+#include <core/quantized_mesh.h>
+#include <memory>
+
+// One placement of a shared mesh, kept either as a Model or as a QuantizedMesh. The mesh is never modified, so any
+// number of instances can reference it and the geometry is stored once however often it is placed.
+class Instance {
+public:
+    Instance(std::shared_ptr<const Model> mesh, const matrix4 &model_matrix);
+
+    Instance(std::shared_ptr<const QuantizedMesh> mesh, const matrix4 &model_matrix);
+
+    // Null for quantized instances
+    [[nodiscard]] const std::shared_ptr<const Model> &get_mesh() const;
+
+    // Null for instances of a Model
+    [[nodiscard]] const std::shared_ptr<const QuantizedMesh> &get_quantized_mesh() const;
+
+    [[nodiscard]] int get_face_count() const;
+
+    // Model space bounding box of the mesh
+    [[nodiscard]] const BoundingBox &get_bounding_box() const;
+
+    [[nodiscard]] const matrix4 &get_model_matrix() const;
+
+    [[nodiscard]] const matrix3 &get_normal_matrix() const;
+
+private:
+    std::shared_ptr<const Model> m_mesh;
+    std::shared_ptr<const QuantizedMesh> m_quantized_mesh;
+    matrix4 m_model_matrix;
+    matrix3 m_normal_matrix;
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <core/model.h>
+#include <memory>
+#include <vector>
+
+// Levels of detail of a model, simplified by quadric error edge collapse. Level 0 is the model itself and every level
+// has about reduction times the faces of the one before, down to min_face_count. Build it from a loaded model, before
+// the vertex shader moved it to screen space.
+class ModelLOD {
+public:
+    explicit ModelLOD(const std::shared_ptr<Model> &model, float reduction = 0.25f, int min_face_count = 256);
+
+    [[nodiscard]] int get_level_count() const;
+
+    [[nodiscard]] const std::shared_ptr<Model> &get_level(int level) const;
+
+    // Estimated distance between a level and the model, in world units. It comes from the quadric error metric and
+    // is not a strict bound, a few points of the level may be further away.
+    [[nodiscard]] float get_error(int level) const;
+
+    // Coarsest level whose error covers at most max_pixel_error pixels, pixels_per_unit is the size of one world unit
+    // on screen at the point of the model nearest to the camera
+    [[nodiscard]] int select_level(float pixels_per_unit, float max_pixel_error = 0.5f) const;
+
+    // Simplify model to at most target_face_count faces. Vertices with the same position are welded first, so normal
+    // seams do not open. error is set to an estimate of the distance moved by the surface.
+    static std::shared_ptr<Model> simplify(const Model &model, int target_face_count, float &error);
+
+private:
+    std::vector<std::shared_ptr<Model>> m_levels;
+    std::vector<float> m_errors;
+};
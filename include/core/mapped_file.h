@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read only view of a whole file, mapped into memory instead of copied. The contents are not null terminated.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filename);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    [[nodiscard]] bool is_open() const;
+
+    [[nodiscard]] const char *data() const;
+
+    [[nodiscard]] size_t size() const;
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size      = 0;
+    bool m_open        = false;
+#if defined(_WIN32)
+    void *m_file    = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
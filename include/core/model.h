@@ -5,12 +5,21 @@
 #include <cstdint>
 #include <memory>
 
+class MappedFile;
+
+// OBJ models. Parsed meshes are cached in a binary <filename>.cache next to the source, which is reused until the
+// source changes.
 class Model {
 public:
     Model() = default;
 
     explicit Model(const std::string &filename, const matrix4 &model_matrix = matrix4::identity());
 
+    // Parse filename straight into its mesh cache without building the model, for meshes which do not fit in memory.
+    // The file is parsed in windows and its attributes go through scratch files next to the cache, only the map of
+    // distinct vertices stays in memory. False if the cache could not be written, parse errors throw.
+    static bool build_cache(const std::string &filename);
+
     static std::shared_ptr<Model> combine(const std::shared_ptr<Model> &model1, const std::shared_ptr<Model> &model2);
 
     [[nodiscard]] Model copy() const;
@@ -19,11 +28,38 @@ public:
 
     [[nodiscard]] float3 get_centroid(uint32_t index) const;
 
+    // Recompute face normals from vertices and faces, facing the same side as the vertex normals if there are any and
+    // the side the face winds counter-clockwise around otherwise
+    void compute_face_normals();
+
+    // Sort faces along a Morton curve over their centroids and renumber vertices in the order the faces first use
+    // them. Consecutive faces then cover nearby pixels and read nearby vertices. Optional, run once after loading.
+    void reorder_faces();
+
+    [[nodiscard]] bool has_normals() const {
+        return !normals.empty() || (source_normals != nullptr && !source_normals->empty());
+    }
+
+    // Normal of vertex index, vertices made by clipping come after the ones covered by source_normals
+    [[nodiscard]] const float3 &get_normal(int index) const {
+        if (source_normals == nullptr) {
+            return normals[index];
+        }
+        auto source_count = static_cast<int>(source_normals->size());
+        return index < source_count ? (*source_normals)[index] : normals[index - source_count];
+    }
+
     std::vector<float4> vertices; // Vertex positions
     std::vector<float3> normals;  // Vertex normals
     std::vector<int3> faces;      // Faces
     std::vector<float3> face_normals;
     BoundingBox bounding_box;
+    int first_face_id    = 0;     // Triangle id of faces[0] in the gbuffer, batches of a ModelStream follow each other
+    bool cull_back_faces = false; // Drop faces whose face normal points away from the camera, for closed meshes only
+
+    // Normals of the model a screen space model was shaded from, read in place instead of copied. normals then only
+    // holds the ones of vertices made by clipping. The source model has to outlive the screen space one.
+    const std::vector<float3> *source_normals = nullptr;
 
 private:
     matrix4 m_model_matrix;
@@ -36,12 +72,100 @@ private:
 
         explicit OBJVertex() = default;
 
-        explicit OBJVertex(const std::string &string);
-
         bool operator==(const OBJVertex &v) const;
     };
 
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const;
+    // Flat open addressing map from OBJ vertex to vertex index with linear probing, kept at most half full
+    class OBJVertexMap {
+    public:
+        OBJVertexMap(size_t expected_size, size_t position_count);
+
+        // Index of v, or new_index after adding v if it was not in the map yet
+        uint32_t insert(const OBJVertex &v, uint32_t new_index);
+
+    private:
+        static constexpr uint32_t EmptySlot = static_cast<uint32_t>(-1);
+
+        struct Slot {
+            OBJVertex vertex;
+            uint32_t index = EmptySlot;
+        };
+
+        std::vector<Slot> m_slots;
+        size_t m_size           = 0;
+        size_t m_position_count = 1;
+
+        [[nodiscard]] size_t home_slot(const OBJVertex &v) const;
+
+        void grow();
+    };
+
+    // Everything parsed from one newline aligned part of the file
+    struct OBJChunk {
+        std::vector<float3> positions;
+        std::vector<float3> normals;
+        std::vector<OBJVertex> corners;    // Three per triangle
+        std::vector<int> relative_corners; // corner * 3 + component of indices still relative to the chunk start
+        int uv_count = 0;
     };
+
+    static void parse_chunk(const std::string &filename, const char *file_begin, const char *begin, const char *end,
+                            OBJChunk &chunk);
+
+    // Split [begin, end) into newline aligned chunks of at least 1MB and parse them in parallel
+    static void parse_chunks(const std::string &filename, const char *file_begin, const char *begin, const char *end,
+                             std::vector<OBJChunk> &chunks);
+
+    // Make the relative indices of chunk absolute, offset holds the positions, uvs and normals before it
+    static void resolve_chunk(OBJChunk &chunk, const int3 &offset);
+
+    // Fill faces and return the object space attributes of every vertex
+    void parse_obj(const std::string &filename, const MappedFile &file, std::vector<float3> &vertex_positions,
+                   std::vector<float3> &vertex_normals);
+
+    // Point into the mapped cache if it was built from this source, vertex_normals is null for models without normals
+    bool read_cache(const MappedFile &cache, const std::string &cache_filename, const MappedFile &source,
+                    int64_t source_mtime, const float3 *&vertex_positions, const float3 *&vertex_normals,
+                    int &vertex_count);
+
+    void write_cache(const std::string &cache_filename, const MappedFile &source, int64_t source_mtime,
+                     const std::vector<float3> &vertex_positions, const std::vector<float3> &vertex_normals) const;
+};
+
+// Faces of an OBJ model read from its mesh cache in batches, for meshes which do not fit in memory as one Model.
+// Every batch holds at most batch_size faces and only the vertices they use, and can be drawn into the same frame as
+// the batches before it. A missing or stale cache is built by Model::build_cache, without loading the whole model.
+class ModelStream {
+public:
+    explicit ModelStream(const std::string &filename, const matrix4 &model_matrix = matrix4::identity(),
+                         int batch_size = 1 << 20);
+
+    ~ModelStream();
+
+    [[nodiscard]] bool is_open() const;
+
+    [[nodiscard]] int get_face_count() const;
+
+    // Replace the contents of batch with the next faces, false once every face was read
+    bool next(Model &batch);
+
+    void rewind();
+
+private:
+    std::unique_ptr<MappedFile> m_cache;
+    matrix4 m_model_matrix;
+    matrix3 m_normal_matrix;
+    int m_batch_size;
+    int m_next_face = 0;
+
+    // Object space arrays inside the mapped cache
+    const float3 *m_positions = nullptr;
+    const float3 *m_normals   = nullptr;
+    const int3 *m_faces       = nullptr;
+    int m_face_count          = 0;
+
+    // Batch sized scratch, reused by every batch
+    std::vector<int> m_vertex_ids;
+    std::vector<float3> m_batch_positions;
+    std::vector<float3> m_batch_normals;
 };
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <algorithm>
+#include <core/common.h>
+#include <cstdint>
+#include <vector>
+
+// Spread the low 10 bits of v so that there are two zero bits between each of them
+inline uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30 bit Morton code of a point in the unit cube, x takes the highest bit of every triple
+inline uint32_t morton_code(const float3 &p) {
+    auto quantize = [](float v) { return static_cast<uint32_t>(std::min(std::max(v * 1024.0f, 0.0f), 1023.0f)); };
+    return (expand_bits(quantize(p.x)) << 2) | (expand_bits(quantize(p.y)) << 1) | expand_bits(quantize(p.z));
+}
+
+// Stable least significant digit radix sort of keys on bits [shift, shift + bit_count), chunks are sorted in parallel
+extern void radix_sort(std::vector<uint64_t> &keys, int shift, int bit_count);
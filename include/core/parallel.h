@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool {
+public:
+    // thread_count <= 0 uses all hardware threads, the calling thread counts as one of them
+    explicit ThreadPool(int thread_count = 0);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static ThreadPool &global();
+
+    [[nodiscard]] int get_thread_count() const;
+
+    // Split [begin, end) into chunks of grain_size and run func(chunk_begin, chunk_end) on the pool.
+    // Blocks until every chunk is done. Nested calls run serially on the calling thread. If func throws, the chunks not
+    // started yet are skipped and the first exception is rethrown once the workers are idle.
+    void parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &func);
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_submit_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_start_condition;
+    std::condition_variable m_finish_condition;
+
+    const std::function<void(int, int)> *m_job = nullptr;
+    int m_job_begin                            = 0;
+    int m_job_end                              = 0;
+    int m_job_grain                            = 1;
+    int m_chunk_count                          = 0;
+    std::atomic<int> m_next_chunk{ 0 };
+    int m_pending_workers = 0;
+    uint64_t m_generation = 0;
+    bool m_stop           = false;
+    std::exception_ptr m_exception;
+
+    void worker_loop();
+
+    void run_chunks();
+};
+
+// Allocator which leaves elements uninitialized on resize, so the parallel_for that first writes them also decides on
+// which node their pages live. Elements must be written before they are read.
+template <typename T> class FirstTouchAllocator : public std::allocator<T> {
+public:
+    static_assert(std::is_trivially_destructible_v<T>);
+
+    template <typename U> struct rebind {
+        using other = FirstTouchAllocator<U>;
+    };
+
+    FirstTouchAllocator() = default;
+
+    template <typename U> FirstTouchAllocator(const FirstTouchAllocator<U> &) noexcept {}
+
+    template <typename U> void construct(U *) noexcept {}
+
+    template <typename U, typename... Args> void construct(U *p, Args &&...args) {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T> using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
+
+// Run func over [begin, end) on the global thread pool
+extern void parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &func);
+
+extern int get_thread_count();
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <core/boundingbox.h>
+#include <algorithm>
+#include <core/model.h>
+#include <cmath>
+#include <cstdint>
+
+// Compact read only copy of the geometry of a Model. Positions are 16 bit per axis relative to the bounding box,
+// normals are octahedral encoded in 32 bits and faces use 16 bit indices when the mesh has at most 65536 vertices.
+// That is 10 instead of 28 bytes per vertex and 6 instead of 12 bytes per small face, decoded while the vertex shader
+// transforms an instance. Face normals are only kept, octahedral encoded as well, if the model culls back faces.
+class QuantizedMesh {
+public:
+    explicit QuantizedMesh(const Model &model);
+
+    [[nodiscard]] int get_vertex_count() const;
+
+    [[nodiscard]] int get_face_count() const;
+
+    [[nodiscard]] bool has_normals() const;
+
+    // Set if the model culls back faces
+    [[nodiscard]] bool has_face_normals() const;
+
+    [[nodiscard]] const BoundingBox &get_bounding_box() const;
+
+    // Maps (x, y, z, 1) of a quantized position to the model space position
+    [[nodiscard]] const matrix4 &get_position_matrix() const;
+
+    // Decoders are inline, they run once per vertex and instance
+
+    [[nodiscard]] const uint16_t *get_position(int index) const { return m_positions.data() + 3 * index; }
+
+    // Not normalized, the direction is exact up to the quantization
+    [[nodiscard]] float3 get_normal(int index) const { return decode_normal(m_normals[index]); }
+
+    [[nodiscard]] float3 get_face_normal(int index) const { return decode_normal(m_face_normals[index]); }
+
+    [[nodiscard]] int3 get_face(int index) const {
+        if (!m_faces.empty()) {
+            return m_faces[index];
+        }
+        const uint16_t *face = m_short_faces.data() + 3 * index;
+        return { face[0], face[1], face[2] };
+    }
+
+    // Bytes used by positions, normals and faces
+    [[nodiscard]] size_t get_memory_size() const;
+
+private:
+    BoundingBox m_bounding_box;
+    matrix4 m_position_matrix;
+    std::vector<uint16_t> m_positions;    // Three per vertex
+    std::vector<uint32_t> m_normals;      // Octahedral u and v in the low and high 16 bits
+    std::vector<uint32_t> m_face_normals; // Same encoding, empty unless the model culls back faces
+    std::vector<uint16_t> m_short_faces;  // Three per face, if every index fits in 16 bits
+    std::vector<int3> m_faces;            // Otherwise
+
+    static uint32_t encode_normal(const float3 &normal);
+
+    static float3 decode_normal(uint32_t code) {
+        float u = static_cast<float>(code & 0xffff) * (2.0f / 65535.0f) - 1.0f;
+        float v = static_cast<float>(code >> 16) * (2.0f / 65535.0f) - 1.0f;
+        float3 normal(u, v, 1.0f - std::abs(u) - std::abs(v));
+        float t = std::max(-normal.z, 0.0f);
+        normal.x -= std::copysign(t, normal.x);
+        normal.y -= std::copysign(t, normal.y);
+        return normal;
+    }
+};
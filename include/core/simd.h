@@ -0,0 +1,25 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define M_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Functions using wider instruction sets than the build target, only called after a runtime check
+#if defined(__GNUC__) || defined(__clang__)
+#define M_TARGET(isa) __attribute__((target(isa)))
+#else
+#define M_TARGET(isa)
+#endif
+
+enum SimdLevel {
+    EScalar,
+    ESSE41,
+    EAVX2
+};
+
+// Widest instruction set supported by the CPU, or the level forced by set_simd_level
+extern SimdLevel get_simd_level();
+
+// Force a narrower path, e.g. to compare against the scalar fallback. Clamped to what the CPU supports.
+extern void set_simd_level(SimdLevel level);
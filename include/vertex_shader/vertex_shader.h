@@ -1,5 +1,6 @@
 #pragma once
 
+#include <core/instance.h>
 #include <core/model.h>
 #include <memory>
 
@@ -8,15 +9,56 @@ public:
     VertexShader(const matrix4 &view_matrix, const matrix4 &perspective_matrix, const matrix4 &screen_matrix, int width,
                  int height);
 
+    // Transform model in place and remove its faces outside the screen, for scratch models such as stream batches.
+    // Faces crossing the near plane or leaving the guard band are clipped, which appends vertices, normals and faces.
     void apply(const std::shared_ptr<Model> &model) const;
 
+    // Write the screen space vertices and visible faces of model into output, model is left as is and can be drawn
+    // again by any camera or engine. output is overwritten and can be reused for every model and frame.
+    void apply(const Model &model, const std::shared_ptr<Model> &output) const;
+
+    // Write the screen space vertices, normals and faces of one instance into output, the shared mesh is left as is.
+    // output is overwritten and can be reused for every instance.
+    void apply(const Instance &instance, const std::shared_ptr<Model> &output) const;
+
     [[nodiscard]] matrix4 get_transform_matrix() const;
 
+    // Size in pixels of one world unit at the point of a world space bounding box nearest to the camera, infinite if
+    // the camera is inside its bounding sphere
+    [[nodiscard]] float get_pixels_per_unit(const BoundingBox &bbox) const;
+
 private:
     matrix4 m_view_matrix;
     matrix4 m_perspective_matrix;
     matrix4 m_screen_matrix;
     matrix4 m_transform_matrix;
+    float3 m_camera_position;
     int m_width;
     int m_height;
+
+    // Transform the vertices of mesh by matrix into output, then keep the faces which can be on screen. Mesh is one of
+    // the views in vertex_shader.cpp, over float vertices and int faces or over a QuantizedMesh. The normals of output
+    // must be set already, output.normals grows with the vertices made by clipping. Back faces are culled if
+    // face_normals is not empty, it and camera are in the space of the vertices.
+    template <typename Mesh>
+    void shade(const matrix4 &matrix, const Mesh &mesh, const std::vector<float3> &face_normals, const float3 &camera,
+               Model &output) const;
+
+    // Screen space positions of count vertices and their clip space outcodes. input is float4 or three uint16_t per
+    // vertex, it may be output if it is float4. Chunks run on the thread pool, each with the widest SIMD path the CPU
+    // supports.
+    template <typename Input>
+    void transform(const matrix4 &matrix, const Input *input, float4 *output, uint8_t *outcodes, int count) const;
+
+    // Write the faces which are drawn as they are into accepted, in their order, and the indices of the faces which
+    // need clipping into clipped. Faces entirely outside the screen and back faces are in neither. accepted must not
+    // be the faces of mesh.
+    template <typename Mesh>
+    static void cull(const Mesh &mesh, const std::vector<float3> &face_normals, const float3 &camera,
+                     const std::vector<uint8_t> &outcodes, std::vector<int3> &accepted, std::vector<int> &clipped);
+
+    // Clip one face of mesh against the near plane and the guard band, appending what is left to output
+    template <typename Mesh>
+    void clip(const matrix4 &matrix, const Mesh &mesh, const int3 &face, const std::vector<uint8_t> &outcodes,
+              Model &output) const;
 };
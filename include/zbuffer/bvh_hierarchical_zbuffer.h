@@ -1,36 +1,28 @@
 #pragma once
 
 #include <core/bvh.h>
-#include <core/quadtree.h>
+#include <core/depth_pyramid.h>
 #include <zbuffer/zbuffer.h>
 
-typedef TQuadTree<float, int2> QuadTree;
-
 class BVHHierarchicalZBuffer : public ZBuffer {
 public:
-    BVHHierarchicalZBuffer(int width, int height);
+    BVHHierarchicalZBuffer(int width, int height, BVHBuildMethod build_method = ELinear);
 
     ~BVHHierarchicalZBuffer() override;
 
     void apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) override;
 
-private:
-    std::shared_ptr<QuadTree> m_z_pyramid;
-    std::vector<std::shared_ptr<QuadTree>> m_z_buffer;
-    std::shared_ptr<BVHAccel> m_accel;
-
-    std::shared_ptr<QuadTree> build_pyramid(int2 min, int2 max);
+    void reset() override;
 
-    [[nodiscard]] int get_index(int row, int col) const;
+    [[nodiscard]] const BVHStats &get_bvh_stats() const;
 
-    void pyramid_test(const std::shared_ptr<BVHNode> &bvh_node, const std::shared_ptr<QuadTree> &zbuffer_node,
-                      const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
-
-    void leaf_node_test(const std::shared_ptr<BVHNode> &bvh_node, const std::shared_ptr<QuadTree> &zbuffer_node,
-                        const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
+private:
+    DepthPyramid m_z_pyramid;
+    std::shared_ptr<BVHAccel> m_accel;
+    std::vector<int> m_node_stack;
 
-    float node_test(const Fragment &fragment, const std::shared_ptr<QuadTree> &node,
-                    const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
+    // Walk the BVH nearest child first, skipping nodes hidden behind the pyramid
+    void pyramid_test(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
 
-    static void update_z(const std::shared_ptr<QuadTree> &node, float value);
-};
\ No newline at end of file
+    void triangle_test(int tri_id, const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
+};
@@ -3,58 +3,75 @@
 #include <core/gbuffer.h>
 #include <memory>
 #include <core/model.h>
+#include <core/rasterizer.h>
 #include <zbuffer/zbuffer.h>
 
 typedef struct PolygonClassify {
-    float a, b, c, d; // Equation of the polygon
-    int id;           // Triangle id
-    int dy;           // Cross scanline number in y direction
+    int id;         // Triangle id
+    int y;          // First scanline
+    int first_edge; // Edges of the polygon in the edge pool, sorted by first scanline then from left to right
+    int edge_count;
 } PolygonClassify;
 
 typedef struct EdgeClassify {
-    float x;  // x of the top endpoint
-    float y;  // y of the top endpoint
+    float x;  // x at the center of the first scanline
     float dx; // - 1 / k
+    int y;    // First scanline
     int dy;   // Cross scanline number in y direction
-    int id;   // Triangle id
 } EdgeClassify;
 
 typedef struct ActiveEdge {
-    float xl;  // x value of the left intersection
-    float dxl; // x offset when y -= 1
-    int dyl;   // Scanline number left
-    float xr;  // x value of the right intersection
-    float dxr; // x offset when y -= 1
-    int dyr;   // Scanline number left
-    float zl;  // z value of the left intersection
-    float dzx; // z offset when x += 1, typically -a/c
-    float dzy; // z offset when y -= 1, typically b/c
-    int id;    // Triangle id
+    float xl;            // x value of the left intersection
+    float dxl;           // x offset when y -= 1
+    int dyl;             // Scanline number left
+    float xr;            // x value of the right intersection
+    float dxr;           // x offset when y -= 1
+    int dyr;             // Scanline number right
+    int next_edge;       // Edge which replaces the first one to end, -1 if none
+    int id;              // Triangle id in the gbuffer
+    TriangleSetup setup; // Edge functions and depth plane of the triangle, depth is stepped along the span
 } ActiveEdge;
 
+typedef struct ScanlineBand {
+    int min_y, max_y; // Scanlines [min_y, max_y] swept by one worker
+    // Polygons bucketed by first scanline in CSR layout, bucket y is [polygon_offset[y - min_y],
+    // polygon_offset[y - min_y + 1]). Every table keeps its capacity between frames.
+    std::vector<PolygonClassify> classified_polygon_table;
+    std::vector<int> polygon_offset;
+    std::vector<PolygonClassify> polygon_pool;
+    std::vector<EdgeClassify> edge_pool;
+    std::vector<ActiveEdge> active_edge_table;
+} ScanlineBand;
+
 class ScanlineZBuffer : public ZBuffer {
 public:
-    ScanlineZBuffer(int width, int height);
+    // The screen is split into band_count horizontal bands swept in parallel, band_count <= 0 picks four bands per
+    // thread of the pool, or a single band on one thread
+    ScanlineZBuffer(int width, int height, int band_count = 0);
 
     ~ScanlineZBuffer() override;
 
     void apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) override;
 
 private:
-    std::vector<std::vector<PolygonClassify>> m_classified_polygon_table;
-    std::vector<std::vector<EdgeClassify>> m_classified_edge_table;
-    std::vector<PolygonClassify> m_active_polygon_table;
-    std::vector<ActiveEdge> m_active_edge_table;
+    std::vector<ScanlineBand> m_bands;
+    std::vector<int> m_row_band; // Band of every scanline
+    // Triangle ids per binning chunk and band, chunks cover ascending face ranges
+    std::vector<std::vector<std::vector<int>>> m_bins;
+
+    void bin_triangles(int chunk, int begin, int end, const std::shared_ptr<Model> &model);
+
+    void initialize(int band_index, const std::shared_ptr<Model> &model);
 
-    void initialize(const std::shared_ptr<Model> &model);
+    void classify_triangle(ScanlineBand &band, int tri_id, const std::shared_ptr<Model> &model) const;
 
-    void add_active_table(int y);
+    void add_active_table(ScanlineBand &band, int y, const std::shared_ptr<Model> &model) const;
 
-    void update_depth(int y, const std::shared_ptr<GBuffer> &gbuffer, const std::shared_ptr<Model> &model);
+    void update_depth(ScanlineBand &band, int y, const std::shared_ptr<GBuffer> &gbuffer) const;
 
-    void find_replace_edge(int y, ActiveEdge &active_edge) const;
+    static void replace_edge(const ScanlineBand &band, ActiveEdge &active_edge);
 
-    void cull_active_table();
+    static void cull_active_table(ScanlineBand &band);
 
     [[nodiscard]] int above_scanline_count(float y) const;
 };
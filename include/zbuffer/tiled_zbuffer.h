@@ -0,0 +1,22 @@
+#pragma once
+
+#include <zbuffer/zbuffer.h>
+
+class TiledZBuffer : public ZBuffer {
+public:
+    TiledZBuffer(int width, int height, int tile_size = 64);
+
+    ~TiledZBuffer() override;
+
+    void apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) override;
+
+private:
+    int m_tile_size;
+    int m_tile_count_x, m_tile_count_y;
+    // Triangle ids per binning chunk and tile, chunks cover ascending face ranges
+    std::vector<std::vector<std::vector<int>>> m_bins;
+
+    void bin_triangles(int chunk, int begin, int end, const std::shared_ptr<Model> &model);
+
+    void rasterize_tile(int tile, const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) const;
+};
@@ -2,6 +2,7 @@
 
 #include <core/gbuffer.h>
 #include <core/model.h>
+#include <functional>
 #include <memory>
 
 class ZBuffer {
@@ -13,6 +14,24 @@ public:
     virtual void apply(const std::shared_ptr<Model> &model,
                        const std::shared_ptr<GBuffer> &gbuffer) = 0;
 
+    // Clear the internal depth state for a new frame, call together with GBuffer::reset. Consecutive apply calls
+    // without a reset draw into the same frame.
+    virtual void reset();
+
 protected:
     int m_width, m_height;
+
+    // Pixel rectangle around the vertices of model, clamped to the screen
+    static void get_screen_rect(const Model &model, int width, int height, int &min_x, int &max_x, int &min_y,
+                                int &max_y);
+
+    // Split face_count faces into get_thread_count() contiguous chunks and call bin(chunk, begin, end) for each on the
+    // thread pool, after resizing bins to one entry per chunk. Chunks cover ascending face ranges, so bins filled in
+    // face order stay sorted by triangle id.
+    static void bin_in_chunks(int face_count, std::vector<std::vector<std::vector<int>>> &bins,
+                              const std::function<void(int, int, int)> &bin);
+
+    // Fill barycentric and normal buffers from the depth tested triangle ids, once per visible pixel. Only pixels
+    // showing a face of model are touched, so models and stream batches can be drawn into the same frame.
+    static void resolve(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer);
 };
@@ -1,5 +1,7 @@
 #include <core/bitmap.h>
 #include <core/bvh.h>
+#include <core/instance.h>
+#include <core/lod.h>
 #include <core/model.h>
 #include <core/timer.h>
 #include <fragment_shader/fragment_shader.h>
@@ -8,20 +10,73 @@
 #include <zbuffer/hierarchical_zbuffer.h>
 #include <zbuffer/naive_zbuffer.h>
 #include <zbuffer/scanline_zbuffer.h>
+#include <zbuffer/tiled_zbuffer.h>
 
+// Draw model through screen_model, which holds its screen space vertices and visible faces. model is not changed.
 void render(const std::shared_ptr<VertexShader> &vertex_shader, const std::shared_ptr<FragmentShader> &fragment_shader,
-            const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer,
+            const Model &model, const std::shared_ptr<Model> &screen_model, const std::shared_ptr<GBuffer> &gbuffer,
             const std::shared_ptr<ZBuffer> &zbuffer) {
     // Load
     Timer timer;
 
     // Vertex shader
-    vertex_shader->apply(model);
+    vertex_shader->apply(model, screen_model);
     std::cout << "Vertex shader took " << timer.lap_string() << "\n";
 
     // Rasterize and zbuffer
-    zbuffer->apply(model, gbuffer);
+    zbuffer->apply(screen_model, gbuffer);
     std::cout << "zbuffer took " << timer.lap_string() << "\n";
+    if (auto bvh_zbuffer = std::dynamic_pointer_cast<BVHHierarchicalZBuffer>(zbuffer)) {
+        std::cout << bvh_zbuffer->get_bvh_stats().to_string() << "\n";
+    }
+
+    // Fragment shader
+    fragment_shader->apply(gbuffer);
+    std::cout << "Fragment shader took " << timer.lap_string() << "\n";
+}
+
+// Draw the stream batch by batch into one frame, only the current batch is held in memory
+void render_stream(const std::shared_ptr<VertexShader> &vertex_shader,
+                   const std::shared_ptr<FragmentShader> &fragment_shader, ModelStream &stream,
+                   const std::shared_ptr<GBuffer> &gbuffer, const std::shared_ptr<ZBuffer> &zbuffer) {
+    Timer timer;
+
+    // Vertex shader, rasterize and zbuffer
+    auto batch        = std::make_shared<Model>();
+    int batch_count   = 0;
+    int first_face_id = 0;
+    stream.rewind();
+    while (stream.next(*batch)) {
+        // Clipping can add faces, ids follow the faces drawn rather than the ones in the file
+        vertex_shader->apply(batch);
+        batch->first_face_id = first_face_id;
+        first_face_id += static_cast<int>(batch->faces.size());
+        zbuffer->apply(batch, gbuffer);
+        batch_count++;
+    }
+    std::cout << batch_count << " batches took " << timer.lap_string() << "\n";
+
+    // Fragment shader
+    fragment_shader->apply(gbuffer);
+    std::cout << "Fragment shader took " << timer.lap_string() << "\n";
+}
+
+// Draw every instance into one frame, each one is transformed into the same scratch model
+void render_instances(const std::shared_ptr<VertexShader> &vertex_shader,
+                      const std::shared_ptr<FragmentShader> &fragment_shader, const std::vector<Instance> &instances,
+                      const std::shared_ptr<GBuffer> &gbuffer, const std::shared_ptr<ZBuffer> &zbuffer) {
+    Timer timer;
+
+    // Vertex shader, rasterize and zbuffer
+    auto output       = std::make_shared<Model>();
+    int first_face_id = 0;
+    for (const Instance &instance : instances) {
+        vertex_shader->apply(instance, output);
+        output->first_face_id = first_face_id;
+        first_face_id += static_cast<int>(output->faces.size());
+        zbuffer->apply(output, gbuffer);
+    }
+    std::cout << instances.size() << " instances took " << timer.lap_string() << "\n";
 
     // Fragment shader
     fragment_shader->apply(gbuffer);
@@ -52,11 +107,25 @@ void object_test() {
         "../assets/depth_result/spiral120k.png", "../assets/depth_result/bunny144k.png"
     };
 
+    // Back faces are culled on the closed meshes, where they are always hidden
+    std::vector<bool> closed{ true, true, true, true, false, true };
+
     auto vertex_shader = std::make_shared<VertexShader>(view_matrix, perspective_matrix, screen_matrix, width, height);
     auto fragment_shader = std::make_shared<FragmentShader>(type, vertex_shader->get_transform_matrix(),
                                                             (camera_target - camera_origin).normalize());
     fragment_shader->set_blinn_phong_params(float3(0, 10, 0), float3(1.0f, 1.0f, 1.0f), float3(0.2f, 0.2f, 0.2f));
 
+    // Buffers are created once and reset before every render
+    auto bitmap       = std::make_shared<Bitmap>(height, width);
+    auto gbuffer      = std::make_shared<GBuffer>(height, width);
+    auto screen_model = std::make_shared<Model>();
+    std::vector<std::shared_ptr<ZBuffer>> zbuffers{
+        std::make_shared<NaiveZBuffer>(width, height), std::make_shared<ScanlineZBuffer>(width, height),
+        std::make_shared<HierarchicalZBuffer>(width, height), std::make_shared<BVHHierarchicalZBuffer>(width, height),
+        std::make_shared<TiledZBuffer>(width, height)
+    };
+    std::vector<std::string> posixes{ "_naive", "_scanline", "_hierarchical", "_bvh", "_tiled" };
+
     int start_index = 0;
     int end_index   = 6;
     for (int i = start_index; i < end_index; i++) {
@@ -86,37 +155,18 @@ void object_test() {
                 break;
         }
 
-        for (int j = 0; j < 4; j++) {
-            auto model   = std::make_shared<Model>(filenames[i], model_matrix);
-            auto bitmap  = std::make_shared<Bitmap>(height, width);
-            auto gbuffer = std::make_shared<GBuffer>(height, width);
-            std::string posix;
-            std::shared_ptr<ZBuffer> zbuffer;
-            switch (j) {
-                case 0:
-                    zbuffer = std::make_shared<NaiveZBuffer>(width, height);
-                    posix   = "_naive";
-                    break;
-                case 1:
-                    zbuffer = std::make_shared<ScanlineZBuffer>(width, height);
-                    posix   = "_scanline";
-                    break;
-                case 2:
-                    zbuffer = std::make_shared<HierarchicalZBuffer>(width, height);
-                    posix   = "_hierarchical";
-                    break;
-                case 3:
-                    zbuffer = std::make_shared<BVHHierarchicalZBuffer>(width, height);
-                    posix   = "_bvh";
-                    break;
-                default:
-                    std::cerr << "Unknown zbuffer type!\n";
-                    return;
-            }
+        // Loaded once, every engine renders the same model
+        Model model(filenames[i], model_matrix);
+        model.cull_back_faces = closed[i];
+        for (int j = 0; j < zbuffers.size(); j++) {
+            const std::string &posix = posixes[j];
+            const auto &zbuffer      = zbuffers[j];
+            gbuffer->reset();
+            zbuffer->reset();
 
             std::cout << "\nStart rendering " << filenames[i] << " with" << posix << " zbuffer" << std::endl;
 
-            render(vertex_shader, fragment_shader, model, gbuffer, zbuffer);
+            render(vertex_shader, fragment_shader, model, screen_model, gbuffer, zbuffer);
 
             // Save result
             bitmap->set_data(gbuffer->m_color_buffer);
@@ -156,40 +206,32 @@ void scene_test() {
                                                             (camera_target - camera_origin).normalize());
     fragment_shader->set_blinn_phong_params(float3(0, 1000, 0), float3(1.0f, 1.0f, 1.0f), float3(0.2f, 0.2f, 0.2f));
 
+    // Buffers are created once and reset before every render
+    auto bitmap       = std::make_shared<Bitmap>(height, width);
+    auto gbuffer      = std::make_shared<GBuffer>(height, width);
+    auto screen_model = std::make_shared<Model>();
+    std::vector<std::shared_ptr<ZBuffer>> zbuffers{
+        std::make_shared<NaiveZBuffer>(width, height), std::make_shared<ScanlineZBuffer>(width, height),
+        std::make_shared<HierarchicalZBuffer>(width, height), std::make_shared<BVHHierarchicalZBuffer>(width, height),
+        std::make_shared<TiledZBuffer>(width, height)
+    };
+    std::vector<std::string> posixes{ "_naive", "_scanline", "_hierarchical", "_bvh", "_tiled" };
+
     int start_index = 0;
     int end_index   = 1;
     for (int i = start_index; i < end_index; i++) {
-        for (int j = 0; j < 4; j++) {
-            auto model   = std::make_shared<Model>(filenames[i], model_matrix);
-            auto bitmap  = std::make_shared<Bitmap>(height, width);
-            auto gbuffer = std::make_shared<GBuffer>(height, width);
-            std::string posix;
-            std::shared_ptr<ZBuffer> zbuffer;
-            switch (j) {
-                case 0:
-                    zbuffer = std::make_shared<NaiveZBuffer>(width, height);
-                    posix   = "_naive";
-                    break;
-                case 1:
-                    zbuffer = std::make_shared<ScanlineZBuffer>(width, height);
-                    posix   = "_scanline";
-                    break;
-                case 2:
-                    zbuffer = std::make_shared<HierarchicalZBuffer>(width, height);
-                    posix   = "_hierarchical";
-                    break;
-                case 3:
-                    zbuffer = std::make_shared<BVHHierarchicalZBuffer>(width, height);
-                    posix   = "_bvh";
-                    break;
-                default:
-                    std::cerr << "Unknown zbuffer type!\n";
-                    return;
-            }
+        // Scene exports list faces in no particular order
+        Model model(filenames[i], model_matrix);
+        model.reorder_faces();
+        for (int j = 0; j < zbuffers.size(); j++) {
+            const std::string &posix = posixes[j];
+            const auto &zbuffer      = zbuffers[j];
+            gbuffer->reset();
+            zbuffer->reset();
 
             std::cout << "\nStart rendering " << filenames[i] << " with" << posix << " zbuffer" << std::endl;
 
-            render(vertex_shader, fragment_shader, model, gbuffer, zbuffer);
+            render(vertex_shader, fragment_shader, model, screen_model, gbuffer, zbuffer);
 
             // Save result
             bitmap->set_data(gbuffer->m_color_buffer);
@@ -202,6 +244,158 @@ void scene_test() {
     }
 }
 
+void instance_test() {
+    // Set parameters
+    int height    = 1280;
+    int width     = 1280;
+    int grid_size = 32;
+    bool quantize = true;
+    Pattern type  = EBlinnPhong;
+    float3 camera_origin(12.0f, 6.0f, 12.0f);
+    float3 camera_target(0.0f, 0.0f, 0.0f);
+    float3 up(0.0f, 1.0f, 0.0f);
+    float fov           = 40.0f;
+    matrix4 view_matrix = matrix4::look_at(camera_origin, camera_target, up);
+    matrix4 perspective_matrix =
+        matrix4::perspective(fov, static_cast<float>(width) / static_cast<float>(height), 0.1f, 100.0f);
+    matrix4 screen_matrix = matrix4::scale(static_cast<float>(width), static_cast<float>(height), 1.0f);
+
+    std::string filename        = "../assets/knob4k.obj";
+    std::string output_filename = "../assets/light_result/knob4k_instances.png";
+
+    auto vertex_shader = std::make_shared<VertexShader>(view_matrix, perspective_matrix, screen_matrix, width, height);
+    auto fragment_shader = std::make_shared<FragmentShader>(type, vertex_shader->get_transform_matrix(),
+                                                            (camera_target - camera_origin).normalize());
+    fragment_shader->set_blinn_phong_params(float3(0, 10, 0), float3(1.0f, 1.0f, 1.0f), float3(0.2f, 0.2f, 0.2f));
+
+    auto bitmap  = std::make_shared<Bitmap>(height, width);
+    auto gbuffer = std::make_shared<GBuffer>(height, width);
+    auto zbuffer = std::make_shared<HierarchicalZBuffer>(width, height);
+
+    // A grid of one shared mesh, which is closed
+    Model loaded(filename);
+    loaded.cull_back_faces = true;
+    auto mesh              = std::make_shared<const Model>(std::move(loaded));
+    auto quantized_mesh    = std::make_shared<const QuantizedMesh>(*mesh);
+    std::vector<Instance> instances;
+    for (int i = 0; i < grid_size; i++) {
+        for (int j = 0; j < grid_size; j++) {
+            float x              = static_cast<float>(i - grid_size / 2) * 0.5f;
+            float z              = static_cast<float>(j - grid_size / 2) * 0.5f;
+            matrix4 model_matrix = matrix4::translate(x, 0, z) * matrix4::scale(0.2f, 0.2f, 0.2f);
+            if (quantize) {
+                instances.emplace_back(quantized_mesh, model_matrix);
+            } else {
+                instances.emplace_back(mesh, model_matrix);
+            }
+        }
+    }
+
+    std::cout << "\nStart rendering " << instances.size() << " instances of " << filename << std::endl;
+    gbuffer->reset();
+    zbuffer->reset();
+    render_instances(vertex_shader, fragment_shader, instances, gbuffer, zbuffer);
+
+    // Save result
+    bitmap->set_data(gbuffer->m_color_buffer);
+    bitmap->save_png(output_filename);
+}
+
+void stream_test() {
+    // Set parameters
+    int height     = 1280;
+    int width      = 1280;
+    int batch_size = 1 << 18;
+    Pattern type   = EBlinnPhong;
+    float3 camera_origin(400.0f, 200.0f, 400.0f);
+    float3 camera_target(0.0f, 0.0f, 0.0f);
+    float3 up(0.0f, 1.0f, 0.0f);
+    float fov            = 40.0f;
+    matrix4 model_matrix = matrix4::identity();
+    matrix4 view_matrix  = matrix4::look_at(camera_origin, camera_target, up);
+    matrix4 perspective_matrix =
+        matrix4::perspective(fov, static_cast<float>(width) / static_cast<float>(height), 1.0f, 10000.0f);
+    matrix4 screen_matrix = matrix4::scale(static_cast<float>(width), static_cast<float>(height), 1.0f);
+
+    std::string filename        = "../assets/stormveil1000k.obj";
+    std::string output_filename = "../assets/light_result/stormveil1000k_stream.png";
+
+    auto vertex_shader = std::make_shared<VertexShader>(view_matrix, perspective_matrix, screen_matrix, width, height);
+    auto fragment_shader = std::make_shared<FragmentShader>(type, vertex_shader->get_transform_matrix(),
+                                                            (camera_target - camera_origin).normalize());
+    fragment_shader->set_blinn_phong_params(float3(0, 1000, 0), float3(1.0f, 1.0f, 1.0f), float3(0.2f, 0.2f, 0.2f));
+
+    auto bitmap  = std::make_shared<Bitmap>(height, width);
+    auto gbuffer = std::make_shared<GBuffer>(height, width);
+    auto zbuffer = std::make_shared<HierarchicalZBuffer>(width, height);
+    ModelStream stream(filename, model_matrix, batch_size);
+    if (!stream.is_open()) {
+        return;
+    }
+
+    std::cout << "\nStart streaming " << filename << " in batches of " << batch_size << " faces" << std::endl;
+    gbuffer->reset();
+    zbuffer->reset();
+    render_stream(vertex_shader, fragment_shader, stream, gbuffer, zbuffer);
+
+    // Save result
+    bitmap->set_data(gbuffer->m_color_buffer);
+    bitmap->save_png(output_filename);
+}
+
+void lod_test() {
+    // Set parameters
+    int height        = 1280;
+    int width         = 1280;
+    Pattern type      = EBlinnPhong;
+    float distances[] = { 4.0f, 128.0f, 512.0f };
+    float3 camera_target(0.0f, 1.0f, 0.0f);
+    float3 up(0.0f, 1.0f, 0.0f);
+    float fov = 40.0f;
+    matrix4 perspective_matrix =
+        matrix4::perspective(fov, static_cast<float>(width) / static_cast<float>(height), 0.1f, 1000.0f);
+    matrix4 screen_matrix = matrix4::scale(static_cast<float>(width), static_cast<float>(height), 1.0f);
+
+    std::string filename        = "../assets/teapot15k.obj";
+    std::string output_filename = "../assets/light_result/teapot15k_lod";
+
+    // Levels are built once, every frame draws one of them through the same screen model
+    Timer timer;
+    auto model             = std::make_shared<Model>(filename);
+    model->cull_back_faces = true;
+    ModelLOD lod(model);
+    std::cout << "\nBuilding " << lod.get_level_count() << " levels of " << filename << " took " << timer.lap_string()
+              << std::endl;
+    for (int level = 0; level < lod.get_level_count(); level++) {
+        std::cout << "Level " << level << ": " << lod.get_level(level)->faces.size() << " faces, error "
+                  << lod.get_error(level) << std::endl;
+    }
+
+    auto bitmap       = std::make_shared<Bitmap>(height, width);
+    auto gbuffer      = std::make_shared<GBuffer>(height, width);
+    auto zbuffer      = std::make_shared<HierarchicalZBuffer>(width, height);
+    auto screen_model = std::make_shared<Model>();
+    for (float distance : distances) {
+        float3 camera_origin = camera_target + float3(1.0f, 0.5f, 1.0f).normalize() * distance;
+        matrix4 view_matrix  = matrix4::look_at(camera_origin, camera_target, up);
+        auto vertex_shader =
+            std::make_shared<VertexShader>(view_matrix, perspective_matrix, screen_matrix, width, height);
+        auto fragment_shader = std::make_shared<FragmentShader>(type, vertex_shader->get_transform_matrix(),
+                                                                (camera_target - camera_origin).normalize());
+        fragment_shader->set_blinn_phong_params(camera_origin, float3(1.0f, 1.0f, 1.0f), float3(0.2f, 0.2f, 0.2f));
+
+        int level = lod.select_level(vertex_shader->get_pixels_per_unit(lod.get_level(0)->bounding_box));
+        std::cout << "\nStart rendering level " << level << " at distance " << distance << std::endl;
+        gbuffer->reset();
+        zbuffer->reset();
+        render(vertex_shader, fragment_shader, *lod.get_level(level), screen_model, gbuffer, zbuffer);
+
+        // Save result
+        bitmap->set_data(gbuffer->m_color_buffer);
+        bitmap->save_png(output_filename + "_" + std::to_string(static_cast<int>(distance)) + ".png");
+    }
+}
+
 int main() {
     scene_test();
 
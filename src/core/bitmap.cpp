@@ -22,8 +22,6 @@ Bitmap::Bitmap(int height, int width) : m_rows(height), m_cols(width) {
     std::fill(m_data.begin(), m_data.end(), float3(0.0f, 0.0f, 0.0f));
 }
 
-void Bitmap::set_data(std::vector<float3> data) { m_data = std::move(data); }
-
 int Bitmap::index(int row, int col) const { return row * m_cols + col; }
 
 void Bitmap::save_exr(const std::string &filename) const {
@@ -1,62 +1,417 @@
+#include <atomic>
 #include <core/bvh.h>
+#include <core/morton.h>
+#include <core/parallel.h>
+#include <core/timer.h>
+#include <limits>
+#include <sstream>
 
-BVHNode::BVHNode(const BoundingBox &bounding_box_)
-    : bounding_box(bounding_box_), left(nullptr), right(nullptr), is_leaf(false) {}
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Relative cost of testing a node against the depth pyramid and of testing one triangle
+static constexpr float TraversalCost = 1.0f;
+static constexpr float PrimitiveCost = 1.0f;
+static constexpr int BinCount        = 16;
+
+// Inline versions of the BoundingBox helpers, these run in the innermost build loops
+static void grow(BoundingBox &bbox, const BoundingBox &other) {
+    bbox.m_min_p = bbox.m_min_p.wise_min(other.m_min_p);
+    bbox.m_max_p = bbox.m_max_p.wise_max(other.m_max_p);
+}
+
+static void grow(BoundingBox &bbox, const float3 &p) {
+    bbox.m_min_p = bbox.m_min_p.wise_min(p);
+    bbox.m_max_p = bbox.m_max_p.wise_max(p);
+}
+
+static float surface_area(const BoundingBox &bbox) {
+    float3 d = bbox.m_max_p - bbox.m_min_p;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+struct BVHBin {
+    BoundingBox bounds;
+    int count = 0;
+};
+
+// Largest leaf a LinearBVHNode can hold
+static constexpr int MaxLeafSize = std::numeric_limits<uint16_t>::max();
+
+std::string BVHStats::to_string() const {
+    std::ostringstream stream;
+    stream << "BVH built in " << build_time << "ms, " << node_count << " nodes, " << leaf_count
+           << " leaves, depth " << max_depth << ", SAH cost " << sah_cost << "\nLeaf sizes:";
+    for (int i = 0; i < leaf_histogram.size(); i++) {
+        int low  = i == 0 ? 1 : (1 << (i - 1)) + 1;
+        int high = 1 << i;
+        stream << " [" << low;
+        if (high != low) {
+            stream << "-" << high;
+        }
+        stream << "] " << leaf_histogram[i];
+    }
+    return stream.str();
+}
 
 BVHAccel::BVHAccel(int max_depth_, int max_primitives_per_leaf_) {
     max_depth               = max_depth_;
     max_primitives_per_leaf = max_primitives_per_leaf_;
+    build_method            = ESAH;
 }
 
 void BVHAccel::set_model(const std::shared_ptr<Model> &mesh) {
     model = mesh;
 }
 
+void BVHAccel::set_build_method(BVHBuildMethod method) { build_method = method; }
+
 void BVHAccel::construct() {
-    primitives.reserve(model->faces.size());
-    for (uint32_t i = 0; i < model->faces.size(); ++i) {
-        primitives.emplace_back(i);
+    Timer timer;
+    int face_count = static_cast<int>(model->faces.size());
+    primitives.resize(face_count);
+    primitive_bounds.resize(face_count);
+    centroids.resize(face_count);
+
+    // Per face bounds, reduced per chunk and then merged
+    constexpr int grain_size = 1 << 14;
+    std::vector<BoundingBox> chunk_bounds((face_count + grain_size - 1) / grain_size);
+    std::vector<BoundingBox> chunk_centroid_bounds(chunk_bounds.size());
+    parallel_for(0, face_count, grain_size, [&](int begin, int end) {
+        BoundingBox bbox, centroid_bbox;
+        for (int i = begin; i < end; i++) {
+            primitives[i]       = i;
+            primitive_bounds[i] = model->get_bounding_box(i);
+            centroids[i]        = primitive_bounds[i].get_center();
+            grow(bbox, primitive_bounds[i]);
+            grow(centroid_bbox, centroids[i]);
+        }
+        chunk_bounds[begin / grain_size]          = bbox;
+        chunk_centroid_bounds[begin / grain_size] = centroid_bbox;
+    });
+    bounding_box = BoundingBox();
+    BoundingBox centroid_bbox;
+    for (int i = 0; i < chunk_bounds.size(); i++) {
+        grow(bounding_box, chunk_bounds[i]);
+        grow(centroid_bbox, chunk_centroid_bounds[i]);
     }
-    bounding_box = model->bounding_box;
-    root = build_tree(primitives, 0);
+
+    stats = BVHStats();
+    nodes.clear();
+    if (face_count == 0) {
+        return;
+    }
+    nodes.reserve(2 * face_count - 1);
+    if (build_method == ELinear) {
+        build_linear(centroid_bbox, bounding_box.get_surface_area());
+    } else {
+        build_tree(0, face_count, 0, bounding_box, centroid_bbox, bounding_box.get_surface_area());
+    }
+    stats.build_time = timer.elapsed();
 }
 
 const BoundingBox &BVHAccel::get_bounding_box() const { return bounding_box; }
 
-std::shared_ptr<BVHNode> BVHAccel::build_tree(std::vector<int> &primitives, int depth) {
-    if (primitives.size() <= max_primitives_per_leaf || depth >= max_depth) {
-        auto node        = std::make_shared<BVHNode>(BoundingBox());
-        node->is_leaf    = true;
-        node->primitives = primitives;
+const BVHStats &BVHAccel::get_stats() const { return stats; }
+
+const std::vector<LinearBVHNode> &BVHAccel::get_nodes() const { return nodes; }
+
+const std::vector<int> &BVHAccel::get_primitives() const { return primitives; }
+
+void BVHAccel::make_leaf(const BoundingBox &bbox, int begin, int end, int depth, float root_area) {
+    int count             = end - begin;
+    LinearBVHNode &node   = nodes.emplace_back();
+    node.min_p            = bbox.m_min_p;
+    node.max_p            = bbox.m_max_p;
+    node.primitive_offset = begin;
+    node.primitive_count  = static_cast<uint16_t>(count);
+    node.axis             = 0;
+
+    int bucket = 0;
+    while ((1 << bucket) < count) {
+        bucket++;
+    }
+    if (stats.leaf_histogram.size() <= bucket) {
+        stats.leaf_histogram.resize(bucket + 1);
+    }
+    stats.leaf_histogram[bucket]++;
+    stats.leaf_count++;
+    stats.node_count++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+    if (root_area > 0) {
+        stats.sah_cost += PrimitiveCost * static_cast<float>(count) * bbox.get_surface_area() / root_area;
+    }
+}
+
+int BVHAccel::make_interior(const BoundingBox &bbox, int axis, float root_area) {
+    int node_index       = static_cast<int>(nodes.size());
+    LinearBVHNode &node  = nodes.emplace_back();
+    node.min_p           = bbox.m_min_p;
+    node.max_p           = bbox.m_max_p;
+    node.primitive_count = 0;
+    node.axis            = static_cast<uint8_t>(axis);
+
+    stats.node_count++;
+    if (root_area > 0) {
+        stats.sah_cost += TraversalCost * bbox.get_surface_area() / root_area;
+    }
+    return node_index;
+}
+
+void BVHAccel::build_tree(int begin, int end, int depth, const BoundingBox &bbox, const BoundingBox &centroid_bbox,
+                          float root_area) {
+    int count = end - begin;
+    if (count == 1 || (depth >= max_depth && count <= MaxLeafSize)) {
+        make_leaf(bbox, begin, end, depth, root_area);
+        return;
+    }
 
-        for (const auto &prim : primitives) {
-            node->bounding_box.expand_by(model->get_bounding_box(prim));
+    // Bin centroids along every axis in one pass
+    BVHBin bins[3][BinCount];
+    float3 extent = centroid_bbox.get_extents();
+    float3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale(axis) = extent(axis) > 0 ? BinCount / extent(axis) : 0;
+    }
+    for (int i = begin; i < end; i++) {
+        int prim              = primitives[i];
+        const float3 &centroid = centroids[prim];
+        for (int axis = 0; axis < 3; axis++) {
+            int bin = std::min(static_cast<int>((centroid(axis) - centroid_bbox.m_min_p(axis)) * scale(axis)),
+                               BinCount - 1);
+            grow(bins[axis][bin].bounds, primitive_bounds[prim]);
+            bins[axis][bin].count++;
         }
-        return node;
     }
 
-    // Find the largest axis
-    BoundingBox bbox;
-    for (const auto &prim : primitives) {
-        bbox.expand_by(model->get_bounding_box(prim));
+    // Find the split with the lowest surface area heuristic cost
+    float area      = bbox.get_surface_area();
+    float best_cost = M_MAX_FLOAT;
+    int best_axis   = -1;
+    int best_split  = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent(axis) <= 0) {
+            continue;
+        }
+
+        // Sweep from the right to get the cost of every right side, then from the left
+        float right_cost[BinCount];
+        BoundingBox right_bounds;
+        int right_count = 0;
+        for (int bin = BinCount - 1; bin > 0; bin--) {
+            grow(right_bounds, bins[axis][bin].bounds);
+            right_count += bins[axis][bin].count;
+            right_cost[bin] = right_count > 0 ? surface_area(right_bounds) * static_cast<float>(right_count) : 0;
+        }
+        BoundingBox left_bounds;
+        int left_count = 0;
+        for (int split = 1; split < BinCount; split++) {
+            grow(left_bounds, bins[axis][split - 1].bounds);
+            left_count += bins[axis][split - 1].count;
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+            float cost = TraversalCost +
+                         PrimitiveCost * (surface_area(left_bounds) * static_cast<float>(left_count) +
+                                          right_cost[split]) / area;
+            if (cost < best_cost) {
+                best_cost  = cost;
+                best_axis  = axis;
+                best_split = split;
+            }
+        }
     }
-    int axis = bbox.get_major_axis();
 
-    std::shared_ptr<Model> temp_model = model;
+    // Stop when testing every primitive is cheaper than splitting
+    float leaf_cost = PrimitiveCost * static_cast<float>(count);
+    if (count <= max_primitives_per_leaf && (best_axis < 0 || leaf_cost <= best_cost)) {
+        make_leaf(bbox, begin, end, depth, root_area);
+        return;
+    }
 
-    // Sort primitives along the chosen axis
-    std::sort(primitives.begin(), primitives.end(), [axis, temp_model](const uint32_t a, const uint32_t b) {
-        return temp_model->get_centroid(a)(axis) < temp_model->get_centroid(b)(axis);
+    int mid;
+    BoundingBox left_bbox, right_bbox, left_centroid_bbox, right_centroid_bbox;
+    if (best_axis >= 0) {
+        float min        = centroid_bbox.m_min_p(best_axis);
+        float axis_scale = scale(best_axis);
+        auto it          = std::partition(primitives.begin() + begin, primitives.begin() + end, [&](int prim) {
+            int bin = std::min(static_cast<int>((centroids[prim](best_axis) - min) * axis_scale), BinCount - 1);
+            return bin < best_split;
+        });
+        mid = static_cast<int>(it - primitives.begin());
+        for (int bin = 0; bin < BinCount; bin++) {
+            grow(bin < best_split ? left_bbox : right_bbox, bins[best_axis][bin].bounds);
+        }
+        for (int i = begin; i < end; i++) {
+            grow(i < mid ? left_centroid_bbox : right_centroid_bbox, centroids[primitives[i]]);
+        }
+    } else { // Centroids all coincide, split in the middle
+        mid = begin + count / 2;
+        for (int i = begin; i < end; i++) {
+            grow(i < mid ? left_bbox : right_bbox, primitive_bounds[primitives[i]]);
+        }
+        left_centroid_bbox  = centroid_bbox;
+        right_centroid_bbox = centroid_bbox;
+    }
+
+    // Left child directly follows its parent, the right child comes after the whole left subtree
+    int node_index = make_interior(bbox, std::max(best_axis, 0), root_area);
+    build_tree(begin, mid, depth + 1, left_bbox, left_centroid_bbox, root_area);
+    nodes[node_index].right_child_offset = static_cast<int>(nodes.size());
+    build_tree(mid, end, depth + 1, right_bbox, right_centroid_bbox, root_area);
+}
+
+static int leading_zeros(uint64_t v) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, v) ? 63 - static_cast<int>(index) : 64;
+#else
+    return v == 0 ? 64 : __builtin_clzll(v);
+#endif
+}
+
+void BVHAccel::build_linear(const BoundingBox &centroid_bbox, float root_area) {
+    int face_count = static_cast<int>(primitives.size());
+
+    // Morton code in the high bits and face id in the low bits keep every key unique
+    std::vector<uint64_t> keys(face_count);
+    float3 extent = centroid_bbox.get_extents();
+    float3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale(axis) = extent(axis) > 0 ? 1.0f / extent(axis) : 0;
+    }
+    parallel_for(0, face_count, 1 << 14, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            float3 p = (centroids[i] - centroid_bbox.m_min_p) * scale;
+            keys[i]  = static_cast<uint64_t>(morton_code(p)) << 32 | static_cast<uint32_t>(i);
+        }
+    });
+    radix_sort(keys, 32, 32);
+    parallel_for(0, face_count, 1 << 14, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            primitives[i] = static_cast<int>(keys[i] & 0xFFFFFFFFu);
+        }
+    });
+
+    if (face_count == 1) {
+        make_leaf(primitive_bounds[primitives[0]], 0, 1, 0, root_area);
+        return;
+    }
+
+    // Karras 2012: every internal node i covers a key range starting or ending at i, found independently.
+    // Children are encoded as internal node index or ~leaf index.
+    int internal_count = face_count - 1;
+    std::vector<int> children(2 * internal_count);
+    std::vector<int2> ranges(internal_count);
+    std::vector<int> internal_parents(internal_count, -1);
+    std::vector<int> leaf_parents(face_count);
+    auto delta = [&](int i, int j) { return j < 0 || j >= face_count ? -1 : leading_zeros(keys[i] ^ keys[j]); };
+    parallel_for(0, internal_count, 1 << 12, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            // Direction of the range and its other end
+            int direction  = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int delta_min  = delta(i, i - direction);
+            int max_length = 2;
+            while (delta(i, i + max_length * direction) > delta_min) {
+                max_length *= 2;
+            }
+            int length = 0;
+            for (int step = max_length / 2; step >= 1; step /= 2) {
+                if (delta(i, i + (length + step) * direction) > delta_min) {
+                    length += step;
+                }
+            }
+            int j = i + length * direction;
+
+            // Highest differing bit splits the range
+            int delta_node = delta(i, j);
+            int split      = 0;
+            int step       = length;
+            do {
+                step = (step + 1) / 2;
+                if (split + step < length && delta(i, i + (split + step) * direction) > delta_node) {
+                    split += step;
+                }
+            } while (step > 1);
+            split = i + split * direction + std::min(direction, 0);
+
+            int first           = std::min(i, j);
+            int last            = std::max(i, j);
+            int left            = first == split ? ~split : split;
+            int right           = last == split + 1 ? ~(split + 1) : split + 1;
+            children[2 * i]     = left;
+            children[2 * i + 1] = right;
+            ranges[i]           = int2(first, last + 1);
+            for (int child : { left, right }) {
+                if (child < 0) {
+                    leaf_parents[~child] = i;
+                } else {
+                    internal_parents[child] = i;
+                }
+            }
+        }
     });
 
-    // Split primitives into two groups
-    size_t mid = primitives.size() / 2;
-    std::vector left_primitives(primitives.begin(), primitives.begin() + static_cast<long long>(mid));
-    std::vector right_primitives(primitives.begin() + static_cast<long long>(mid), primitives.end());
+    // Refit bottom up, the second child to arrive computes its parent. Subtrees cheaper as a single leaf are
+    // collapsed by the surface area heuristic.
+    std::vector<BoundingBox> internal_bounds(internal_count);
+    std::vector<float> costs(internal_count);
+    std::vector<uint8_t> collapse(internal_count);
+    std::vector<std::atomic<int>> visits(internal_count);
+    auto child_bounds = [&](int child) -> const BoundingBox & {
+        return child < 0 ? primitive_bounds[primitives[~child]] : internal_bounds[child];
+    };
+    auto child_cost = [&](int child) {
+        return child < 0 ? PrimitiveCost * child_bounds(child).get_surface_area() : costs[child];
+    };
+    parallel_for(0, face_count, 1 << 12, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int node = leaf_parents[i];
+            while (node >= 0 && visits[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                int left         = children[2 * node];
+                int right        = children[2 * node + 1];
+                BoundingBox bbox = child_bounds(left);
+                grow(bbox, child_bounds(right));
 
-    auto node   = std::make_shared<BVHNode>(bbox);
-    node->left  = build_tree(left_primitives, depth + 1);
-    node->right = build_tree(right_primitives, depth + 1);
+                float area            = bbox.get_surface_area();
+                float split_cost      = TraversalCost * area + child_cost(left) + child_cost(right);
+                int count             = ranges[node].y - ranges[node].x;
+                float leaf_cost       = PrimitiveCost * static_cast<float>(count) * area;
+                collapse[node]        = count <= max_primitives_per_leaf && leaf_cost <= split_cost;
+                costs[node]           = collapse[node] ? leaf_cost : split_cost;
+                internal_bounds[node] = bbox;
+                node                  = internal_parents[node];
+            }
+        }
+    });
 
-    return node;
-}
\ No newline at end of file
+    // Lay the tree out depth first
+    struct StackEntry {
+        int child;
+        int depth;
+        int parent; // Interior node whose right child this is, or -1
+    };
+    std::vector<StackEntry> stack{ { 0, 0, -1 } };
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        if (entry.parent >= 0) {
+            nodes[entry.parent].right_child_offset = static_cast<int>(nodes.size());
+        }
+        if (entry.child < 0) {
+            make_leaf(child_bounds(entry.child), ~entry.child, ~entry.child + 1, entry.depth, root_area);
+        } else if (collapse[entry.child]) {
+            const int2 &range = ranges[entry.child];
+            make_leaf(internal_bounds[entry.child], range.x, range.y, entry.depth, root_area);
+        } else {
+            // Axis of the highest Morton bit that differs within the node
+            const int2 &range = ranges[entry.child];
+            int bit           = 63 - leading_zeros(keys[range.x] ^ keys[range.y - 1]);
+            int axis          = bit >= 32 ? 2 - (bit - 32) % 3 : 0;
+            int node_index    = make_interior(internal_bounds[entry.child], axis, root_area);
+            stack.push_back({ children[2 * entry.child + 1], entry.depth + 1, node_index });
+            stack.push_back({ children[2 * entry.child], entry.depth + 1, -1 });
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <core/depth_pyramid.h>
+#include <core/parallel.h>
+
+DepthPyramid::DepthPyramid(int width, int height) {
+    int offset = 0;
+    int2 size(width, height);
+    while (true) {
+        m_level_offset.emplace_back(offset);
+        m_level_size.emplace_back(size);
+        offset += size.x * size.y;
+        if (size.x == 1 && size.y == 1) {
+            break;
+        }
+        size = int2((size.x + 1) / 2, (size.y + 1) / 2);
+    }
+    m_depth.resize(offset);
+    clear(static_cast<float>(M_MAX_FLOAT));
+}
+
+void DepthPyramid::clear(float value) {
+    int size = static_cast<int>(m_depth.size());
+    parallel_for(0, size, 1 << 16, [&](int begin, int end) {
+        std::fill(m_depth.begin() + begin, m_depth.begin() + end, value);
+    });
+}
+
+int DepthPyramid::get_level_count() const { return static_cast<int>(m_level_offset.size()); }
+
+int DepthPyramid::get_level_width(int level) const { return m_level_size[level].x; }
+
+int DepthPyramid::get_level_height(int level) const { return m_level_size[level].y; }
+
+float *DepthPyramid::data(int level) { return m_depth.data() + m_level_offset[level]; }
+
+const float *DepthPyramid::data(int level) const { return m_depth.data() + m_level_offset[level]; }
+
+float DepthPyramid::max_depth(int min_x, int max_x, int min_y, int max_y) const {
+    int level = 0;
+    while ((max_x >> level) - (min_x >> level) > 1 || (max_y >> level) - (min_y >> level) > 1) {
+        level++;
+    }
+
+    const float *depth = data(level);
+    int width          = m_level_size[level].x;
+    float max_z        = -M_MAX_FLOAT;
+    for (int y = min_y >> level; y <= max_y >> level; y++) {
+        for (int x = min_x >> level; x <= max_x >> level; x++) {
+            max_z = std::max(max_z, depth[y * width + x]);
+        }
+    }
+    return max_z;
+}
+
+void DepthPyramid::update(int min_x, int max_x, int min_y, int max_y) {
+    for (int level = 1; level < get_level_count(); level++) {
+        min_x >>= 1;
+        max_x >>= 1;
+        min_y >>= 1;
+        max_y >>= 1;
+
+        const float *fine = data(level - 1);
+        float *coarse     = data(level);
+        int2 fine_size    = m_level_size[level - 1];
+        int coarse_width  = m_level_size[level].x;
+        bool changed      = false;
+        for (int y = min_y; y <= max_y; y++) {
+            // Odd sized levels repeat their last row and column
+            const float *row0 = fine + 2 * y * fine_size.x;
+            const float *row1 = fine + std::min(2 * y + 1, fine_size.y - 1) * fine_size.x;
+            for (int x = min_x; x <= max_x; x++) {
+                int x0       = 2 * x;
+                int x1       = std::min(2 * x + 1, fine_size.x - 1);
+                float z      = std::max(std::max(row0[x0], row0[x1]), std::max(row1[x0], row1[x1]));
+                float &old_z = coarse[y * coarse_width + x];
+                if (z != old_z) {
+                    old_z   = z;
+                    changed = true;
+                }
+            }
+        }
+        if (!changed) {
+            break;
+        }
+    }
+}
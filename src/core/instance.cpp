@@ -0,0 +1,25 @@
+#include <core/instance.h>
+
+Instance::Instance(std::shared_ptr<const Model> mesh, const matrix4 &model_matrix)
+    : m_mesh(std::move(mesh)), m_model_matrix(model_matrix),
+      m_normal_matrix(model_matrix.inverse().left_top_corner().transpose()) {}
+
+Instance::Instance(std::shared_ptr<const QuantizedMesh> mesh, const matrix4 &model_matrix)
+    : m_quantized_mesh(std::move(mesh)), m_model_matrix(model_matrix),
+      m_normal_matrix(model_matrix.inverse().left_top_corner().transpose()) {}
+
+const std::shared_ptr<const Model> &Instance::get_mesh() const { return m_mesh; }
+
+const std::shared_ptr<const QuantizedMesh> &Instance::get_quantized_mesh() const { return m_quantized_mesh; }
+
+int Instance::get_face_count() const {
+    return m_mesh ? static_cast<int>(m_mesh->faces.size()) : m_quantized_mesh->get_face_count();
+}
+
+const BoundingBox &Instance::get_bounding_box() const {
+    return m_mesh ? m_mesh->bounding_box : m_quantized_mesh->get_bounding_box();
+}
+
+const matrix4 &Instance::get_model_matrix() const { return m_model_matrix; }
+
+const matrix3 &Instance::get_normal_matrix() const { return m_normal_matrix; }
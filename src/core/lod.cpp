@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <cmath>
+#include <core/lod.h>
+#include <numeric>
+#include <queue>
+
+// Quadrics of boundary edges are weighted up, so open borders keep their shape
+static constexpr double BoundaryWeight = 10.0;
+
+// Faces whose normal turns further than this cosine during a collapse would fold over, the collapse is rejected
+static constexpr float MinNormalCosine = 0.2f;
+
+// Symmetric 4x4 matrix summing squared distances to a set of planes
+struct Quadric {
+    double a[10] = {}; // xx xy xz xw yy yz yw zz zw ww
+
+    static Quadric plane(const float3 &n, float d, double weight) {
+        double x = n.x, y = n.y, z = n.z, w = d;
+        Quadric q;
+        q.a[0] = weight * x * x;
+        q.a[1] = weight * x * y;
+        q.a[2] = weight * x * z;
+        q.a[3] = weight * x * w;
+        q.a[4] = weight * y * y;
+        q.a[5] = weight * y * z;
+        q.a[6] = weight * y * w;
+        q.a[7] = weight * z * z;
+        q.a[8] = weight * z * w;
+        q.a[9] = weight * w * w;
+        return q;
+    }
+
+    void add(const Quadric &q) {
+        for (int i = 0; i < 10; i++) {
+            a[i] += q.a[i];
+        }
+    }
+
+    [[nodiscard]] double evaluate(const float3 &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x + a[4] * y * y + 2 * a[5] * y * z +
+               2 * a[6] * y + a[7] * z * z + 2 * a[8] * z + a[9];
+    }
+
+    // Point of least error, false if it is not unique
+    bool minimize(float3 &p) const {
+        double det = a[0] * (a[4] * a[7] - a[5] * a[5]) - a[1] * (a[1] * a[7] - a[5] * a[2]) +
+                     a[2] * (a[1] * a[5] - a[4] * a[2]);
+        double scale = a[0] + a[4] + a[7];
+        if (std::abs(det) <= 1e-10 * scale * scale * scale) {
+            return false;
+        }
+        double bx = -a[3], by = -a[6], bz = -a[8];
+        p.x = static_cast<float>((bx * (a[4] * a[7] - a[5] * a[5]) - a[1] * (by * a[7] - a[5] * bz) +
+                                  a[2] * (by * a[5] - a[4] * bz)) /
+                                 det);
+        p.y = static_cast<float>((a[0] * (by * a[7] - a[5] * bz) - bx * (a[1] * a[7] - a[5] * a[2]) +
+                                  a[2] * (a[1] * bz - by * a[2])) /
+                                 det);
+        p.z = static_cast<float>((a[0] * (a[4] * bz - by * a[5]) - a[1] * (a[1] * bz - by * a[2]) +
+                                  bx * (a[1] * a[5] - a[4] * a[2])) /
+                                 det);
+        return true;
+    }
+};
+
+// Candidate collapse of vertex u into vertex v, valid while neither vertex changed since it was queued
+struct EdgeCollapse {
+    double cost;
+    int u, v;
+    uint32_t u_version, v_version;
+    float3 position;
+
+    bool operator<(const EdgeCollapse &other) const { return cost > other.cost; }
+};
+
+// Edge collapse state over welded positions
+struct Simplifier {
+    std::vector<float3> positions;
+    std::vector<float3> normal_sums;
+    std::vector<Quadric> quadrics;
+    std::vector<uint32_t> versions;
+    std::vector<int3> faces;
+    std::vector<bool> face_alive;
+    std::vector<std::vector<int>> vertex_faces;
+    std::priority_queue<EdgeCollapse> queue;
+    std::vector<int> neighbors_u, neighbors_v;
+
+    void push(int u, int v) {
+        Quadric q = quadrics[u];
+        q.add(quadrics[v]);
+
+        // The optimal point is trusted only near the edge, nearly flat quadrics put it anywhere
+        const float3 &pu = positions[u];
+        const float3 &pv = positions[v];
+        float3 mid       = (pu + pv) * 0.5f;
+        float3 position;
+        double cost;
+        if (q.minimize(position) && (position - mid).magnitude() <= (pv - pu).magnitude()) {
+            cost = q.evaluate(position);
+        } else {
+            position = mid;
+            cost     = q.evaluate(mid);
+            for (const float3 &p : { pu, pv }) {
+                double c = q.evaluate(p);
+                if (c < cost) {
+                    cost     = c;
+                    position = p;
+                }
+            }
+        }
+        queue.push({ std::max(cost, 0.0), u, v, versions[u], versions[v], position });
+    }
+
+    void gather_neighbors(int u, std::vector<int> &neighbors) const {
+        neighbors.clear();
+        for (int f : vertex_faces[u]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            for (int i = 0; i < 3; i++) {
+                if (faces[f][i] != u) {
+                    neighbors.emplace_back(faces[f][i]);
+                }
+            }
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+    }
+
+    // False if the collapse would fold a face over or pinch the surface into a non manifold one
+    bool can_collapse(const EdgeCollapse &collapse) {
+        int u = collapse.u;
+        int v = collapse.v;
+        gather_neighbors(u, neighbors_u);
+        gather_neighbors(v, neighbors_v);
+        int shared_faces = 0;
+        for (int f : vertex_faces[u]) {
+            const int3 &face = faces[f];
+            shared_faces += face_alive[f] && (face.x == v || face.y == v || face.z == v);
+        }
+        int common = 0;
+        for (int i = 0, j = 0; i < neighbors_u.size() && j < neighbors_v.size();) {
+            if (neighbors_u[i] < neighbors_v[j]) {
+                i++;
+            } else if (neighbors_u[i] > neighbors_v[j]) {
+                j++;
+            } else {
+                common++;
+                i++;
+                j++;
+            }
+        }
+        if (common != shared_faces) {
+            return false;
+        }
+
+        for (int vertex : { u, v }) {
+            for (int f : vertex_faces[vertex]) {
+                const int3 &face = faces[f];
+                if (!face_alive[f] || ((face.x == u || face.y == u || face.z == u) &&
+                                       (face.x == v || face.y == v || face.z == v))) {
+                    continue;
+                }
+                float3 p[3], moved[3];
+                for (int i = 0; i < 3; i++) {
+                    p[i]     = positions[face[i]];
+                    moved[i] = face[i] == vertex ? collapse.position : p[i];
+                }
+                float3 before = (p[1] - p[0]).cross(p[2] - p[0]).normalize();
+                float3 after  = (moved[1] - moved[0]).cross(moved[2] - moved[0]).normalize();
+                if (before.dot(after) < MinNormalCosine) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Move v to the collapse position and replace u by v in every face
+    void collapse(const EdgeCollapse &collapse, int &face_count) {
+        int u = collapse.u;
+        int v = collapse.v;
+        for (int f : vertex_faces[u]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            int3 &face = faces[f];
+            if (face.x == v || face.y == v || face.z == v) {
+                face_alive[f] = false;
+                face_count--;
+                continue;
+            }
+            face = int3(face.x == u ? v : face.x, face.y == u ? v : face.y, face.z == u ? v : face.z);
+            vertex_faces[v].emplace_back(f);
+        }
+        std::vector<int>().swap(vertex_faces[u]);
+        auto &v_faces = vertex_faces[v];
+        v_faces.erase(std::remove_if(v_faces.begin(), v_faces.end(), [&](int f) { return !face_alive[f]; }),
+                      v_faces.end());
+
+        quadrics[v].add(quadrics[u]);
+        positions[v] = collapse.position;
+        normal_sums[v] += normal_sums[u];
+        versions[u]++;
+        versions[v]++;
+
+        gather_neighbors(v, neighbors_v);
+        for (int w : neighbors_v) {
+            push(v, w);
+        }
+    }
+};
+
+std::shared_ptr<Model> ModelLOD::simplify(const Model &model, int target_face_count, float &error) {
+    int vertex_count = static_cast<int>(model.vertices.size());
+    bool has_normals = !model.normals.empty();
+    Simplifier s;
+
+    // Weld vertices with equal positions, their normals are averaged
+    std::vector<int> order(vertex_count);
+    std::iota(order.begin(), order.end(), 0);
+    auto less = [&](int a, int b) {
+        const float4 &p = model.vertices[a];
+        const float4 &q = model.vertices[b];
+        return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z < q.z;
+    };
+    std::sort(order.begin(), order.end(), less);
+    std::vector<int> weld(vertex_count);
+    for (int i = 0; i < vertex_count; i++) {
+        if (i == 0 || less(order[i - 1], order[i])) {
+            s.positions.emplace_back(model.vertices[order[i]]);
+            s.normal_sums.emplace_back(0, 0, 0);
+        }
+        weld[order[i]] = static_cast<int>(s.positions.size()) - 1;
+        if (has_normals) {
+            s.normal_sums.back() += model.normals[order[i]];
+        }
+    }
+    int position_count = static_cast<int>(s.positions.size());
+
+    for (const int3 &face : model.faces) {
+        int3 welded(weld[face.x], weld[face.y], weld[face.z]);
+        if (welded.x != welded.y && welded.y != welded.z && welded.z != welded.x) {
+            s.faces.emplace_back(welded);
+        }
+    }
+    int face_count = static_cast<int>(s.faces.size());
+    s.face_alive.assign(face_count, true);
+    s.vertex_faces.resize(position_count);
+    s.quadrics.resize(position_count);
+    s.versions.assign(position_count, 0);
+
+    // Every vertex starts with the planes of its faces
+    std::vector<float3> face_normals(face_count);
+    for (int f = 0; f < face_count; f++) {
+        const int3 &face = s.faces[f];
+        float3 normal    = (s.positions[face.y] - s.positions[face.x]).cross(s.positions[face.z] - s.positions[face.x]);
+        face_normals[f]  = normal.normalize();
+        Quadric q        = Quadric::plane(face_normals[f], -face_normals[f].dot(s.positions[face.x]), 1.0);
+        for (int i = 0; i < 3; i++) {
+            s.quadrics[face[i]].add(q);
+            s.vertex_faces[face[i]].emplace_back(f);
+        }
+    }
+
+    // Boundary edges belong to a single face, they add a plane through the edge perpendicular to that face
+    std::vector<uint64_t> edges;
+    edges.reserve(3 * face_count);
+    for (int f = 0; f < face_count; f++) {
+        for (int i = 0; i < 3; i++) {
+            auto a = static_cast<uint32_t>(s.faces[f][i]);
+            auto b = static_cast<uint32_t>(s.faces[f][(i + 1) % 3]);
+            edges.emplace_back(static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b));
+        }
+    }
+    std::vector<uint64_t> sorted_edges = edges;
+    std::sort(sorted_edges.begin(), sorted_edges.end());
+    for (int f = 0; f < face_count; f++) {
+        for (int i = 0; i < 3; i++) {
+            uint64_t edge = edges[3 * f + i];
+            auto range    = std::equal_range(sorted_edges.begin(), sorted_edges.end(), edge);
+            int a         = static_cast<int>(edge >> 32);
+            int b         = static_cast<int>(edge & 0xFFFFFFFFu);
+            if (range.second - range.first != 1) {
+                continue;
+            }
+            float3 normal = (s.positions[b] - s.positions[a]).cross(face_normals[f]).normalize();
+            Quadric q     = Quadric::plane(normal, -normal.dot(s.positions[a]), BoundaryWeight);
+            s.quadrics[a].add(q);
+            s.quadrics[b].add(q);
+        }
+    }
+
+    // Cheapest collapses first, the error is estimated from the distance to the planes of the most expensive one
+    for (int f = 0; f < face_count; f++) {
+        for (int i = 0; i < 3; i++) {
+            uint64_t edge = edges[3 * f + i];
+            s.push(static_cast<int>(edge >> 32), static_cast<int>(edge & 0xFFFFFFFFu));
+        }
+    }
+    double max_cost = 0;
+    while (face_count > target_face_count && !s.queue.empty()) {
+        EdgeCollapse collapse = s.queue.top();
+        s.queue.pop();
+        if (s.versions[collapse.u] != collapse.u_version || s.versions[collapse.v] != collapse.v_version ||
+            !s.can_collapse(collapse)) {
+            continue;
+        }
+        s.collapse(collapse, face_count);
+        max_cost = std::max(max_cost, collapse.cost);
+    }
+    error = static_cast<float>(std::sqrt(max_cost));
+
+    // Keep the vertices still used by a face
+    auto result = std::make_shared<Model>();
+    std::vector<int> remap(position_count, -1);
+    for (int f = 0; f < static_cast<int>(s.faces.size()); f++) {
+        if (!s.face_alive[f]) {
+            continue;
+        }
+        int3 face = s.faces[f];
+        for (int i = 0; i < 3; i++) {
+            int &index = remap[face[i]];
+            if (index < 0) {
+                index = static_cast<int>(result->vertices.size());
+                const float3 &p = s.positions[face[i]];
+                result->vertices.emplace_back(p.x, p.y, p.z, 1.0f);
+                result->bounding_box.expand_by(p);
+                if (has_normals) {
+                    result->normals.emplace_back(s.normal_sums[face[i]].normalize());
+                }
+            }
+        }
+        result->faces.emplace_back(remap[face.x], remap[face.y], remap[face.z]);
+    }
+    result->compute_face_normals();
+    result->cull_back_faces = model.cull_back_faces;
+    return result;
+}
+
+ModelLOD::ModelLOD(const std::shared_ptr<Model> &model, float reduction, int min_face_count) {
+    m_levels.emplace_back(model);
+    m_errors.emplace_back(0.0f);
+    while (true) {
+        auto face_count       = static_cast<int>(m_levels.back()->faces.size());
+        auto target_face_count = static_cast<int>(static_cast<float>(face_count) * reduction);
+        if (target_face_count < min_face_count) {
+            break;
+        }
+
+        // Levels are simplified from the one before, so their errors add up. Stop once collapses are mostly rejected.
+        float error = 0;
+        auto level  = simplify(*m_levels.back(), target_face_count, error);
+        if (level->faces.size() > (face_count + target_face_count) / 2) {
+            break;
+        }
+        m_levels.emplace_back(level);
+        m_errors.emplace_back(m_errors.back() + error);
+    }
+}
+
+int ModelLOD::get_level_count() const { return static_cast<int>(m_levels.size()); }
+
+const std::shared_ptr<Model> &ModelLOD::get_level(int level) const { return m_levels[level]; }
+
+float ModelLOD::get_error(int level) const { return m_errors[level]; }
+
+int ModelLOD::select_level(float pixels_per_unit, float max_pixel_error) const {
+    for (int level = get_level_count() - 1; level > 0; level--) {
+        if (m_errors[level] * pixels_per_unit <= max_pixel_error) {
+            return level;
+        }
+    }
+    return 0;
+}
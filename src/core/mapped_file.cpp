@@ -0,0 +1,94 @@
+#include <core/mapped_file.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+MappedFile::MappedFile(const std::string &filename) {
+    // Writers are allowed so a mapped mesh cache can have its header refreshed in place
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    m_file = file;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        return;
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+    m_open = true;
+
+    // Empty files cannot be mapped
+    if (m_size == 0) {
+        return;
+    }
+    m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) {
+        m_open = false;
+        return;
+    }
+    m_data = static_cast<const char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    m_open = m_data != nullptr;
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+}
+#else
+MappedFile::MappedFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat status {};
+    if (fstat(fd, &status) == 0) {
+        m_size = static_cast<size_t>(status.st_size);
+        m_open = true;
+
+        // Empty files cannot be mapped
+        if (m_size > 0) {
+            void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                m_open = false;
+            } else {
+                m_data = static_cast<const char *>(data);
+                madvise(data, m_size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(const_cast<char *>(m_data), m_size);
+    }
+}
+#endif
+
+bool MappedFile::is_open() const { return m_open; }
+
+const char *MappedFile::data() const { return m_data; }
+
+size_t MappedFile::size() const { return m_data ? m_size : 0; }
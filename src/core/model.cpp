@@ -1,106 +1,727 @@
+#include <algorithm>
+#include <core/mapped_file.h>
 #include <core/model.h>
+#include <core/morton.h>
+#include <core/parallel.h>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <sstream>
-#include <unordered_map>
 
-Model::Model(const std::string &filename, const matrix4 &model_matrix) {
-    m_model_matrix  = model_matrix;
-    m_normal_matrix = m_model_matrix.inverse().left_top_corner().transpose();
+// Bytes of the source parsed at once by Model::build_cache, and of the attribute blocks it writes
+static constexpr size_t ParseWindowSize = 1 << 26;
 
-    typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-    std::ifstream is(filename);
-    if (!is) {
-        std::cerr << "Error opening file " << filename << std::endl;
-        return;
+// Locale independent parsers working directly on the file buffer, they advance ptr past what they read
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static void skip_spaces(const char *&ptr, const char *end) {
+    while (ptr < end && is_space(*ptr)) {
+        ptr++;
     }
+}
 
-    std::vector<float3> positions;
-    std::vector<float3> normals;
-    std::vector<uint32_t> indices;
-    std::vector<OBJVertex> vertices;
-    VertexMap vertex_map;
+static void skip_line(const char *&ptr, const char *end) {
+    auto newline = static_cast<const char *>(memchr(ptr, '\n', end - ptr));
+    ptr          = newline ? newline + 1 : end;
+}
+
+static bool parse_int(const char *&ptr, const char *end, int &value) {
+    const char *p = ptr;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    int64_t result = 0;
+    while (p < end && *p >= '0' && *p <= '9' && result <= INT32_MAX) {
+        result = result * 10 + (*p++ - '0');
+    }
+    value = static_cast<int>(negative ? -result : result);
+    ptr   = p;
+    return true;
+}
+
+static bool parse_float(const char *&ptr, const char *end, float &value) {
+    // Powers of ten up to 1e22 are exact in double precision
+    static const double powers[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    const char *p = ptr;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+
+    // Up to 19 significant digits, the rest only moves the decimal point
+    uint64_t mantissa = 0;
+    int digits        = 0;
+    int exponent      = 0;
+    bool any_digit    = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any_digit = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any_digit = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0;
+                exponent--;
+            }
+        }
+    }
+    if (!any_digit) {
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *exponent_ptr = p + 1;
+        int exponent_value;
+        if (parse_int(exponent_ptr, end, exponent_value)) {
+            exponent += exponent_value;
+            p = exponent_ptr;
+        }
+    }
+
+    auto result = static_cast<double>(mantissa);
+    if (exponent < 0) {
+        result = exponent >= -22 ? result / powers[-exponent] : result * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ? result * powers[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = static_cast<float>(negative ? -result : result);
+    ptr   = p;
+    return true;
+}
 
-    std::string line_str;
-    while (std::getline(is, line_str)) {
-        std::istringstream line(line_str);
+// 1-based line number of ptr, only needed for error messages
+static int line_number(const char *begin, const char *ptr) {
+    return 1 + static_cast<int>(std::count(begin, ptr, '\n'));
+}
 
-        std::string prefix;
-        line >> prefix;
+void Model::parse_chunk(const std::string &filename, const char *file_begin, const char *begin, const char *end,
+                        OBJChunk &chunk) {
+    const char *ptr = begin;
+    auto error      = [&](const char *what) {
+        return std::runtime_error(std::string(what) + " in " + filename + " at line " +
+                                  std::to_string(line_number(file_begin, ptr)));
+    };
+    std::vector<OBJVertex> polygon;
+    std::vector<int> polygon_relative;
+    while (ptr < end) {
+        skip_spaces(ptr, end);
+        size_t remaining = end - ptr;
 
-        if (prefix == "v") {
+        if (remaining >= 2 && ptr[0] == 'v' && is_space(ptr[1])) {
             float3 p;
-            line >> p.x >> p.y >> p.z;
-            positions.emplace_back(p);
-        } else if (prefix == "vn") {
+            ptr += 2;
+            for (int i = 0; i < 3; i++) {
+                skip_spaces(ptr, end);
+                if (!parse_float(ptr, end, p(i))) {
+                    throw error("Invalid vertex position");
+                }
+            }
+            chunk.positions.emplace_back(p);
+        } else if (remaining >= 3 && ptr[0] == 'v' && ptr[1] == 'n' && is_space(ptr[2])) {
             float3 n;
-            line >> n.x >> n.y >> n.z;
-            normals.emplace_back(n.normalize());
-        } else if (prefix == "f") {
-            std::string v1, v2, v3, v4;
-            line >> v1 >> v2 >> v3 >> v4;
-            OBJVertex vertex[6];
-            int n_vertices = 3;
-
-            vertex[0] = OBJVertex(v1);
-            vertex[1] = OBJVertex(v2);
-            vertex[2] = OBJVertex(v3);
-
-            if (!v4.empty()) {
-                vertex[3]  = OBJVertex(v4);
-                vertex[4]  = vertex[0];
-                vertex[5]  = vertex[2];
-                n_vertices = 6;
-            }
-            for (int i = 0; i < n_vertices; ++i) {
-                const OBJVertex &v           = vertex[i];
-                VertexMap::const_iterator it = vertex_map.find(v);
-                if (it == vertex_map.end()) {
-                    vertex_map[v] = static_cast<uint32_t>(vertices.size());
-                    indices.push_back(static_cast<uint32_t>(vertices.size()));
-                    vertices.push_back(v);
-                } else {
-                    indices.push_back(it->second);
+            ptr += 3;
+            for (int i = 0; i < 3; i++) {
+                skip_spaces(ptr, end);
+                if (!parse_float(ptr, end, n(i))) {
+                    throw error("Invalid vertex normal");
+                }
+            }
+            chunk.normals.emplace_back(n.normalize());
+        } else if (remaining >= 3 && ptr[0] == 'v' && ptr[1] == 't' && is_space(ptr[2])) {
+            chunk.uv_count++;
+        } else if (remaining >= 2 && ptr[0] == 'f' && is_space(ptr[1])) {
+            // Vertices are p, p/uv, p//n or p/uv/n, negative indices count back from the latest element
+            polygon.clear();
+            polygon_relative.clear();
+            ptr += 2;
+            skip_spaces(ptr, end);
+            while (ptr < end && *ptr != '\n' && *ptr != '#') {
+                int index[3]    = { 0, 0, 0 };
+                bool present[3] = { false, false, false };
+                int counts[3]   = { static_cast<int>(chunk.positions.size()), chunk.uv_count,
+                                    static_cast<int>(chunk.normals.size()) };
+                for (int i = 0; i < 3; i++) {
+                    if (i > 0) {
+                        if (ptr == end || *ptr != '/') {
+                            break;
+                        }
+                        ptr++;
+                        if (ptr < end && *ptr == '/') {
+                            continue;
+                        }
+                    }
+                    if (!parse_int(ptr, end, index[i]) || index[i] == 0) {
+                        throw error("Invalid face vertex");
+                    }
+                    if (index[i] < 0) {
+                        // Relative to this chunk for now, may still point into an earlier one
+                        index[i] += counts[i] + 1;
+                        polygon_relative.emplace_back(static_cast<int>(polygon.size()) * 3 + i);
+                    }
+                    present[i] = true;
+                }
+                if (ptr < end && !is_space(*ptr) && *ptr != '\n') {
+                    throw error("Invalid face vertex");
+                }
+
+                OBJVertex &vertex = polygon.emplace_back();
+                vertex.p          = static_cast<uint32_t>(index[0]);
+                if (present[1]) {
+                    vertex.uv = static_cast<uint32_t>(index[1]);
+                }
+                if (present[2]) {
+                    vertex.n = static_cast<uint32_t>(index[2]);
+                }
+                skip_spaces(ptr, end);
+            }
+            if (polygon.size() < 3) {
+                throw error("Face with fewer than three vertices");
+            }
+
+            // Polygons are split into (0, 1, 2), then (k, 0, k - 1) for every further vertex k
+            for (int k = 2; k < polygon.size(); k++) {
+                int corners[3] = { 0, 1, 2 };
+                if (k > 2) {
+                    corners[0] = k;
+                    corners[1] = 0;
+                    corners[2] = k - 1;
+                }
+                for (int corner : corners) {
+                    for (int relative : polygon_relative) {
+                        if (relative / 3 == corner) {
+                            chunk.relative_corners.emplace_back(static_cast<int>(chunk.corners.size()) * 3 +
+                                                                relative % 3);
+                        }
+                    }
+                    chunk.corners.emplace_back(polygon[corner]);
                 }
             }
         }
+        skip_line(ptr, end);
     }
+}
 
-    this->faces.resize(static_cast<long long>(indices.size() / 3));
-    for (uint32_t i = 0; i < faces.size(); ++i) {
-        this->faces[i] = int3(static_cast<int>(indices[i * 3]), static_cast<int>(indices[i * 3 + 1]),
-                              static_cast<int>(indices[i * 3 + 2]));
+void Model::parse_chunks(const std::string &filename, const char *file_begin, const char *begin, const char *end,
+                         std::vector<OBJChunk> &chunks) {
+    // Newline aligned chunks of at least 1MB
+    size_t size     = end - begin;
+    int chunk_count = static_cast<int>(std::min<size_t>(4 * get_thread_count(), size / (1 << 20) + 1));
+    std::vector<const char *> chunk_begin(chunk_count + 1, end);
+    chunk_begin[0] = begin;
+    for (int i = 1; i < chunk_count; i++) {
+        const char *ptr = std::max(begin + size * i / chunk_count, chunk_begin[i - 1]);
+        skip_line(ptr, end);
+        chunk_begin[i] = ptr;
     }
 
-    this->vertices.resize(static_cast<long long>(vertices.size()));
-    for (uint32_t i = 0; i < vertices.size(); ++i) {
-        auto vertex = float4(float3(positions.at(vertices[i].p - 1)).x, float3(positions.at(vertices[i].p - 1)).y,
-                             float3(positions.at(vertices[i].p - 1)).z, 1);
-        vertex      = m_model_matrix * vertex;
-        vertex /= vertex.w;
-        this->vertices[i] = vertex;
-        bounding_box.expand_by(float3(vertex.x, vertex.y, vertex.z));
+    chunks.clear();
+    chunks.resize(chunk_count);
+    std::vector<std::exception_ptr> chunk_errors(chunk_count);
+    parallel_for(0, chunk_count, 1, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            try {
+                parse_chunk(filename, file_begin, chunk_begin[i], chunk_begin[i + 1], chunks[i]);
+            } catch (...) {
+                chunk_errors[i] = std::current_exception();
+            }
+        }
+    });
+    for (const std::exception_ptr &chunk_error : chunk_errors) {
+        if (chunk_error) {
+            std::rethrow_exception(chunk_error);
+        }
     }
+}
 
-    // Calculate vertex normal
-    if (!normals.empty()) {
-        this->normals.resize(static_cast<long long>(vertices.size()));
-        for (uint32_t i = 0; i < vertices.size(); ++i) {
-            auto normal      = normals.at(vertices[i].n - 1).normalize();
-            normal           = m_normal_matrix * normal;
-            this->normals[i] = normal.normalize();
+void Model::resolve_chunk(OBJChunk &chunk, const int3 &offset) {
+    for (int relative : chunk.relative_corners) {
+        OBJVertex &vertex = chunk.corners[relative / 3];
+        uint32_t &index   = relative % 3 == 0 ? vertex.p : relative % 3 == 1 ? vertex.uv : vertex.n;
+        index             = static_cast<uint32_t>(static_cast<int>(index) + offset[relative % 3]);
+    }
+}
+
+void Model::parse_obj(const std::string &filename, const MappedFile &file, std::vector<float3> &vertex_positions,
+                      std::vector<float3> &vertex_normals) {
+    std::vector<OBJChunk> chunks;
+    parse_chunks(filename, file.data(), file.data(), file.data() + file.size(), chunks);
+    int chunk_count = static_cast<int>(chunks.size());
+
+    // Element offsets of every chunk
+    std::vector<int3> chunk_offsets(chunk_count + 1, int3(0, 0, 0));
+    for (int i = 0; i < chunk_count; i++) {
+        chunk_offsets[i + 1] = chunk_offsets[i] + int3(static_cast<int>(chunks[i].positions.size()), chunks[i].uv_count,
+                                                       static_cast<int>(chunks[i].normals.size()));
+    }
+    std::vector<float3> positions(chunk_offsets[chunk_count].x);
+    std::vector<float3> normals(chunk_offsets[chunk_count].z);
+    parallel_for(0, chunk_count, 1, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            std::copy(chunks[i].positions.begin(), chunks[i].positions.end(),
+                      positions.begin() + chunk_offsets[i].x);
+            std::copy(chunks[i].normals.begin(), chunks[i].normals.end(), normals.begin() + chunk_offsets[i].z);
+            resolve_chunk(chunks[i], chunk_offsets[i]);
         }
+    });
+
+    // Deduplicate in file order so the vertex order does not depend on the chunking. There are at least as many
+    // vertices as elements of the largest attribute, usually about that many.
+    size_t corner_count = 0;
+    for (const OBJChunk &chunk : chunks) {
+        corner_count += chunk.corners.size();
     }
+    size_t attribute_count = std::max(std::max(positions.size(), normals.size()),
+                                      static_cast<size_t>(chunk_offsets[chunk_count].y));
+    std::vector<OBJVertex> vertices;
+    vertices.reserve(std::min(corner_count, attribute_count));
+    OBJVertexMap vertex_map(std::min(corner_count, attribute_count), positions.size());
+    auto vertex_index = [&](const OBJVertex &v) {
+        auto new_index = static_cast<uint32_t>(vertices.size());
+        uint32_t index = vertex_map.insert(v, new_index);
+        if (index == new_index) {
+            if (v.p - 1 >= positions.size() || (!normals.empty() && v.n - 1 >= normals.size())) {
+                throw std::runtime_error("Face vertex out of range in " + filename);
+            }
+            vertices.push_back(v);
+        }
+        return static_cast<int>(index);
+    };
+    this->faces.clear();
+    this->faces.reserve(corner_count / 3);
+    for (const OBJChunk &chunk : chunks) {
+        for (size_t i = 0; i < chunk.corners.size(); i += 3) {
+            int v0 = vertex_index(chunk.corners[i]);
+            int v1 = vertex_index(chunk.corners[i + 1]);
+            int v2 = vertex_index(chunk.corners[i + 2]);
+            this->faces.emplace_back(v0, v1, v2);
+        }
+    }
+    chunks.clear();
 
-    // Calculate face normal
-    face_normals.resize(faces.size());
-    for (int i = 0; i < faces.size(); i++) {
-        float3 p0(this->vertices[faces[i].x]);
-        float3 p1(this->vertices[faces[i].y]);
-        float3 p2(this->vertices[faces[i].z]);
-        float3 normal = (p2 - p0).cross(p1 - p0).normalize();
-        normal = normal.dot(this->normals[faces[i].x]) > 0 ? normal : -normal;
-        face_normals[i] = normal;
+    // Object space attributes of every deduplicated vertex
+    int vertex_count = static_cast<int>(vertices.size());
+    vertex_positions.resize(vertex_count);
+    vertex_normals.resize(normals.empty() ? 0 : vertex_count);
+    parallel_for(0, vertex_count, 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            vertex_positions[i] = positions[vertices[i].p - 1];
+            if (!normals.empty()) {
+                vertex_normals[i] = normals[vertices[i].n - 1];
+            }
+        }
+    });
+}
+
+// 64 bit hash of the source file, only used to notice changed files. Blocks are hashed in parallel.
+static uint64_t hash_file(const MappedFile &file) {
+    constexpr size_t block_size = 1 << 20;
+    const char *data            = file.data();
+    size_t size                 = file.size();
+    std::vector<uint64_t> block_hashes((size + block_size - 1) / block_size);
+    parallel_for(0, static_cast<int>(block_hashes.size()), 1, [&](int first, int last) {
+        for (int block = first; block < last; block++) {
+            const char *begin = data + block * block_size;
+            size_t length     = std::min(block_size, size - block * block_size);
+            uint64_t hash     = 0xcbf29ce484222325ull;
+            size_t i          = 0;
+            for (; i + 8 <= length; i += 8) {
+                uint64_t word;
+                memcpy(&word, begin + i, 8);
+                hash = (hash ^ word) * 0x100000001b3ull;
+                hash ^= hash >> 29;
+            }
+            for (; i < length; i++) {
+                hash = (hash ^ static_cast<uint8_t>(begin[i])) * 0x100000001b3ull;
+            }
+            block_hashes[block] = hash;
+        }
+    });
+
+    uint64_t hash = 0xcbf29ce484222325ull ^ size;
+    for (uint64_t block_hash : block_hashes) {
+        hash = (hash ^ block_hash) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static int64_t file_mtime(const std::string &filename) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(filename, error);
+    return error ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+// Mesh cache layout: this header, then object space vertex positions, vertex normals and faces
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t normal_count;
+    uint32_t face_count;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+};
+
+static const char MeshCacheMagic[8]        = { 'Z', 'B', 'M', 'E', 'S', 'H', '\0', '\0' };
+static constexpr uint32_t MeshCacheVersion = 1;
+
+static_assert(sizeof(float3) == 12 && sizeof(int3) == 12, "Mesh cache stores tightly packed vectors");
+
+static MeshCacheHeader make_cache_header(const MappedFile &source, int64_t source_mtime, size_t vertex_count,
+                                         size_t normal_count, size_t face_count) {
+    MeshCacheHeader header{};
+    memcpy(header.magic, MeshCacheMagic, sizeof(MeshCacheMagic));
+    header.version      = MeshCacheVersion;
+    header.vertex_count = static_cast<uint32_t>(vertex_count);
+    header.normal_count = static_cast<uint32_t>(normal_count);
+    header.face_count   = static_cast<uint32_t>(face_count);
+    header.source_size  = source.size();
+    header.source_mtime = source_mtime;
+    header.source_hash  = hash_file(source);
+    return header;
+}
+
+// True if the mapped cache is complete and was built from this source
+static bool check_cache(const MappedFile &cache, const std::string &cache_filename, const MappedFile &source,
+                        int64_t source_mtime, MeshCacheHeader &header) {
+    if (cache.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, cache.data(), sizeof(header));
+    size_t attribute_count = static_cast<size_t>(header.vertex_count) + header.normal_count;
+    size_t expected_size   = sizeof(header) + sizeof(float3) * attribute_count + sizeof(int3) * header.face_count;
+    if (memcmp(header.magic, MeshCacheMagic, sizeof(MeshCacheMagic)) != 0 || header.version != MeshCacheVersion ||
+        cache.size() != expected_size || header.source_size != source.size() ||
+        (header.normal_count != 0 && header.normal_count != header.vertex_count)) {
+        return false;
+    }
+
+    // A touched but unchanged source keeps its cache
+    if (header.source_mtime != source_mtime && header.source_hash != hash_file(source)) {
+        return false;
+    }
+
+    // Faces index the mapped vertices without further checks, so a damaged cache must not point past them
+    const char *face_data = cache.data() + sizeof(header) + sizeof(float3) * attribute_count;
+    const auto *faces     = reinterpret_cast<const int3 *>(face_data);
+    int face_count        = static_cast<int>(header.face_count);
+    std::vector<char> chunk_valid((face_count + (1 << 16) - 1) >> 16, 1);
+    parallel_for(0, face_count, 1 << 16, [&](int first, int last) {
+        bool valid = true;
+        for (int i = first; i < last; i++) {
+            for (int k = 0; k < 3; k++) {
+                valid &= static_cast<uint32_t>(faces[i][k]) < header.vertex_count;
+            }
+        }
+        chunk_valid[first >> 16] = valid;
+    });
+    if (!std::all_of(chunk_valid.begin(), chunk_valid.end(), [](char valid) { return valid != 0; })) {
+        return false;
+    }
+
+    // Store the new mtime so later loads skip the hash, a cache that cannot be written is only hashed again
+    if (header.source_mtime != source_mtime) {
+        header.source_mtime = source_mtime;
+        std::fstream stream(cache_filename, std::ios::binary | std::ios::in | std::ios::out);
+        stream.seekp(offsetof(MeshCacheHeader, source_mtime));
+        stream.write(reinterpret_cast<const char *>(&source_mtime), sizeof(source_mtime));
+    }
+    return true;
+}
+
+bool Model::read_cache(const MappedFile &cache, const std::string &cache_filename, const MappedFile &source,
+                       int64_t source_mtime, const float3 *&vertex_positions, const float3 *&vertex_normals,
+                       int &vertex_count) {
+    MeshCacheHeader header{};
+    if (!check_cache(cache, cache_filename, source, source_mtime, header)) {
+        return false;
+    }
+
+    const char *data = cache.data() + sizeof(header);
+    vertex_count     = static_cast<int>(header.vertex_count);
+    vertex_positions = reinterpret_cast<const float3 *>(data);
+    vertex_normals   = header.normal_count ? vertex_positions + header.vertex_count : nullptr;
+    faces.resize(header.face_count);
+    memcpy(static_cast<void *>(faces.data()), vertex_positions + header.vertex_count + header.normal_count,
+           sizeof(int3) * header.face_count);
+    return true;
+}
+
+void Model::write_cache(const std::string &cache_filename, const MappedFile &source, int64_t source_mtime,
+                        const std::vector<float3> &vertex_positions, const std::vector<float3> &vertex_normals) const {
+    MeshCacheHeader header =
+        make_cache_header(source, source_mtime, vertex_positions.size(), vertex_normals.size(), faces.size());
+
+    // Write to a temporary file first so that readers never see a partial cache, failures only cost the cache
+    std::string temp_filename = cache_filename + ".tmp";
+    {
+        std::ofstream os(temp_filename, std::ios::binary);
+        if (!os) {
+            return;
+        }
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char *>(vertex_positions.data()), sizeof(float3) * vertex_positions.size());
+        os.write(reinterpret_cast<const char *>(vertex_normals.data()), sizeof(float3) * vertex_normals.size());
+        os.write(reinterpret_cast<const char *>(faces.data()), sizeof(int3) * faces.size());
+        if (!os) {
+            os.close();
+            std::remove(temp_filename.c_str());
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_filename, cache_filename, error);
+    if (error) {
+        std::remove(temp_filename.c_str());
+    }
+}
+
+// Lines starting with "v ", counted in parallel blocks before the file is parsed. Only used to spread the vertex map.
+static size_t count_positions(const MappedFile &file) {
+    constexpr size_t block_size = 1 << 20;
+    const char *data            = file.data();
+    size_t size                 = file.size();
+    std::vector<size_t> block_counts((size + block_size - 1) / block_size);
+    parallel_for(0, static_cast<int>(block_counts.size()), 1, [&](int first, int last) {
+        for (int block = first; block < last; block++) {
+            const char *ptr = data + block * block_size;
+            const char *end = data + std::min(size, (block + 1) * block_size);
+            size_t count    = 0;
+            if (block == 0 && size >= 2 && data[0] == 'v' && is_space(data[1])) {
+                count++;
+            }
+            while ((ptr = static_cast<const char *>(memchr(ptr, '\n', end - ptr))) != nullptr) {
+                ptr++;
+                if (data + size - ptr >= 2 && ptr[0] == 'v' && is_space(ptr[1])) {
+                    count++;
+                }
+            }
+            block_counts[block] = count;
+        }
+    });
+    size_t count = 0;
+    for (size_t block_count : block_counts) {
+        count += block_count;
+    }
+    return count;
+}
+
+// Intermediate file of Model::build_cache, removed however the build ends
+struct ScratchFile {
+    std::string filename;
+    std::ofstream stream;
+
+    explicit ScratchFile(std::string filename_)
+        : filename(std::move(filename_)), stream(filename, std::ios::binary | std::ios::trunc) {}
+
+    ~ScratchFile() {
+        stream.close();
+        std::remove(filename.c_str());
+    }
+};
+
+bool Model::build_cache(const std::string &filename) {
+    MappedFile source(filename);
+    if (!source.is_open()) {
+        std::cerr << "Error opening file " << filename << std::endl;
+        return false;
+    }
+    std::string cache_filename = filename + ".cache";
+    int64_t source_mtime       = file_mtime(filename);
+
+    // Positions and normals in file order and the faces of the deduplicated vertices go to scratch files as the
+    // windows are parsed. Only the vertex map grows with the mesh.
+    ScratchFile positions_file(cache_filename + ".positions.tmp");
+    ScratchFile normals_file(cache_filename + ".normals.tmp");
+    ScratchFile faces_file(cache_filename + ".faces.tmp");
+    if (!positions_file.stream || !normals_file.stream || !faces_file.stream) {
+        return false;
+    }
+
+    // There are usually about as many vertices as positions, the map is sized for them before parsing
+    const char *begin     = source.data();
+    const char *end       = begin + source.size();
+    size_t position_count = count_positions(source);
+    std::vector<OBJVertex> vertices;
+    OBJVertexMap vertex_map(position_count, position_count);
+    uint32_t max_position = 0;
+    uint32_t max_normal   = 0;
+    auto vertex_index     = [&](const OBJVertex &v) {
+        auto new_index = static_cast<uint32_t>(vertices.size());
+        uint32_t index = vertex_map.insert(v, new_index);
+        if (index == new_index) {
+            // Indices are checked once every attribute is known, missing ones wrap around to the largest value
+            max_position = std::max(max_position, v.p - 1);
+            max_normal   = std::max(max_normal, v.n - 1);
+            vertices.push_back(v);
+        }
+        return static_cast<int>(index);
+    };
+
+    int3 offset(0, 0, 0);
+    size_t face_count = 0;
+    std::vector<OBJChunk> chunks;
+    std::vector<int3> window_faces;
+    for (const char *window = begin; window < end;) {
+        const char *window_end = window + std::min<size_t>(ParseWindowSize, end - window);
+        skip_line(window_end, end);
+        parse_chunks(filename, begin, window, window_end, chunks);
+        window_faces.clear();
+        for (OBJChunk &chunk : chunks) {
+            resolve_chunk(chunk, offset);
+            offset += int3(static_cast<int>(chunk.positions.size()), chunk.uv_count,
+                           static_cast<int>(chunk.normals.size()));
+            positions_file.stream.write(reinterpret_cast<const char *>(chunk.positions.data()),
+                                        sizeof(float3) * chunk.positions.size());
+            normals_file.stream.write(reinterpret_cast<const char *>(chunk.normals.data()),
+                                      sizeof(float3) * chunk.normals.size());
+            for (size_t i = 0; i < chunk.corners.size(); i += 3) {
+                int v0 = vertex_index(chunk.corners[i]);
+                int v1 = vertex_index(chunk.corners[i + 1]);
+                int v2 = vertex_index(chunk.corners[i + 2]);
+                window_faces.emplace_back(v0, v1, v2);
+            }
+        }
+        faces_file.stream.write(reinterpret_cast<const char *>(window_faces.data()),
+                                sizeof(int3) * window_faces.size());
+        face_count += window_faces.size();
+        window = window_end;
+    }
+    if (!vertices.empty() && (max_position >= static_cast<uint32_t>(offset.x) ||
+                              (offset.z != 0 && max_normal >= static_cast<uint32_t>(offset.z)))) {
+        throw std::runtime_error("Face vertex out of range in " + filename);
+    }
+    positions_file.stream.close();
+    normals_file.stream.close();
+    faces_file.stream.close();
+    if (!positions_file.stream || !normals_file.stream || !faces_file.stream) {
+        return false;
+    }
+
+    MappedFile positions(positions_file.filename);
+    MappedFile normals(normals_file.filename);
+    MappedFile faces(faces_file.filename);
+    if (!positions.is_open() || !normals.is_open() || !faces.is_open()) {
+        return false;
+    }
+    size_t normal_count    = offset.z == 0 ? 0 : vertices.size();
+    MeshCacheHeader header = make_cache_header(source, source_mtime, vertices.size(), normal_count, face_count);
+
+    // Same layout and contents as write_cache, the attributes of every vertex are gathered block by block
+    std::string temp_filename = cache_filename + ".tmp";
+    {
+        std::ofstream os(temp_filename, std::ios::binary);
+        if (!os) {
+            return false;
+        }
+        os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        std::vector<float3> block;
+        for (int attribute = 0; attribute < (normal_count ? 2 : 1); attribute++) {
+            const auto *values = reinterpret_cast<const float3 *>(attribute ? normals.data() : positions.data());
+            for (size_t first = 0; first < vertices.size(); first += ParseWindowSize / sizeof(float3)) {
+                int count = static_cast<int>(std::min(ParseWindowSize / sizeof(float3), vertices.size() - first));
+                block.resize(count);
+                parallel_for(0, count, 1 << 16, [&](int block_begin, int block_end) {
+                    for (int i = block_begin; i < block_end; i++) {
+                        const OBJVertex &v = vertices[first + i];
+                        block[i]           = values[(attribute ? v.n : v.p) - 1];
+                    }
+                });
+                os.write(reinterpret_cast<const char *>(block.data()), sizeof(float3) * count);
+            }
+        }
+        os.write(faces.data(), static_cast<std::streamsize>(faces.size()));
+        if (!os) {
+            os.close();
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_filename, cache_filename, error);
+    if (error) {
+        std::remove(temp_filename.c_str());
+        return false;
     }
+    return true;
+}
+
+// Fill vertices, normals, bounding box and face normals of model from object space attributes, faces are already set
+static void transform_attributes(const float3 *positions, const float3 *normals, int vertex_count,
+                                 const matrix4 &model_matrix, const matrix3 &normal_matrix, Model &model) {
+    model.vertices.resize(vertex_count);
+    model.bounding_box = BoundingBox();
+    std::vector<BoundingBox> chunk_bounds((vertex_count + (1 << 16) - 1) >> 16);
+    parallel_for(0, vertex_count, 1 << 16, [&](int first, int last) {
+        BoundingBox bbox;
+        for (int i = first; i < last; ++i) {
+            const float3 &position = positions[i];
+            auto vertex            = float4(position.x, position.y, position.z, 1);
+            vertex                 = model_matrix * vertex;
+            vertex /= vertex.w;
+            model.vertices[i] = vertex;
+            bbox.expand_by(float3(vertex.x, vertex.y, vertex.z));
+        }
+        chunk_bounds[first >> 16] = bbox;
+    });
+    for (const BoundingBox &bbox : chunk_bounds) {
+        model.bounding_box.expand_by(bbox);
+    }
+
+    // Calculate vertex normal
+    model.normals.clear();
+    if (normals) {
+        model.normals.resize(vertex_count);
+        parallel_for(0, vertex_count, 1 << 16, [&](int first, int last) {
+            for (int i = first; i < last; ++i) {
+                auto normal      = normals[i].normalize();
+                normal           = normal_matrix * normal;
+                model.normals[i] = normal.normalize();
+            }
+        });
+    }
+
+    model.compute_face_normals();
+}
+
+Model::Model(const std::string &filename, const matrix4 &model_matrix) {
+    m_model_matrix  = model_matrix;
+    m_normal_matrix = m_model_matrix.inverse().left_top_corner().transpose();
+
+    MappedFile file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file " << filename << std::endl;
+        return;
+    }
+
+    // Object space vertices come straight from the mapped cache when it matches the source
+    std::string cache_filename = filename + ".cache";
+    int64_t source_mtime       = file_mtime(filename);
+    MappedFile cache(cache_filename);
+    const float3 *positions = nullptr;
+    const float3 *normals   = nullptr;
+    int vertex_count        = 0;
+    std::vector<float3> parsed_positions, parsed_normals;
+    if (!cache.is_open() || !read_cache(cache, cache_filename, file, source_mtime, positions, normals, vertex_count)) {
+        parse_obj(filename, file, parsed_positions, parsed_normals);
+        write_cache(cache_filename, file, source_mtime, parsed_positions, parsed_normals);
+        positions    = parsed_positions.data();
+        normals      = parsed_normals.empty() ? nullptr : parsed_normals.data();
+        vertex_count = static_cast<int>(parsed_positions.size());
+    }
+
+    transform_attributes(positions, normals, vertex_count, m_model_matrix, m_normal_matrix, *this);
 }
 
 std::shared_ptr<Model> Model::combine(const std::shared_ptr<Model> &model1, const std::shared_ptr<Model> &model2) {
@@ -136,6 +757,9 @@ std::shared_ptr<Model> Model::combine(const std::shared_ptr<Model> &model1, cons
     // Handle bounding box
     combined_model->bounding_box = BoundingBox::merge(model1->bounding_box, model2->bounding_box);
 
+    // Back faces are only hidden if both parts are closed
+    combined_model->cull_back_faces = model1->cull_back_faces && model2->cull_back_faces;
+
     return combined_model;
 }
 
@@ -168,26 +792,240 @@ float3 Model::get_centroid(uint32_t index) const {
     return float3(vertices[faces[index].x] + vertices[faces[index].y] + vertices[faces[index].z]) * (1.0f / 3.0f);
 }
 
-Model::OBJVertex::OBJVertex(const std::string &string) {
-    std::vector<std::string> tokens = tokenize(string, "/", true);
+void Model::compute_face_normals() {
+    face_normals.resize(faces.size());
+    parallel_for(0, static_cast<int>(faces.size()), 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            float3 p0(vertices[faces[i].x]);
+            float3 p1(vertices[faces[i].y]);
+            float3 p2(vertices[faces[i].z]);
+            // OBJ faces wind counter-clockwise around their front side
+            float3 normal = (p1 - p0).cross(p2 - p0).normalize();
+            if (!normals.empty() && normal.dot(normals[faces[i].x]) <= 0) {
+                normal = -normal;
+            }
+            face_normals[i] = normal;
+        }
+    });
+}
+
+void Model::reorder_faces() {
+    int face_count   = static_cast<int>(faces.size());
+    int vertex_count = static_cast<int>(vertices.size());
+    if (face_count == 0) {
+        return;
+    }
 
-    if (tokens.empty() || tokens.size() > 3)
-        throw std::runtime_error("Invalid vertex data: " + string);
+    std::vector<float3> centroids(face_count);
+    std::vector<BoundingBox> chunk_bounds((face_count + (1 << 16) - 1) >> 16);
+    parallel_for(0, face_count, 1 << 16, [&](int first, int last) {
+        BoundingBox bbox;
+        for (int i = first; i < last; i++) {
+            centroids[i] = get_centroid(i);
+            bbox.expand_by(centroids[i]);
+        }
+        chunk_bounds[first >> 16] = bbox;
+    });
+    BoundingBox centroid_bbox;
+    for (const BoundingBox &bbox : chunk_bounds) {
+        centroid_bbox.expand_by(bbox);
+    }
+
+    // Morton code in the high bits and face id in the low bits keep every key unique
+    std::vector<uint64_t> keys(face_count);
+    float3 extent = centroid_bbox.get_extents();
+    float3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale(axis) = extent(axis) > 0 ? 1.0f / extent(axis) : 0;
+    }
+    parallel_for(0, face_count, 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            float3 p = (centroids[i] - centroid_bbox.m_min_p) * scale;
+            keys[i]  = static_cast<uint64_t>(morton_code(p)) << 32 | static_cast<uint32_t>(i);
+        }
+    });
+    radix_sort(keys, 32, 32);
 
-    p = to_uint(tokens[0]);
+    // Vertices are numbered by first use, unused ones keep their relative order at the end
+    std::vector<int> vertex_order(vertex_count, -1);
+    int next_vertex = 0;
+    for (uint64_t key : keys) {
+        const int3 &face = faces[key & 0xFFFFFFFFu];
+        for (int i = 0; i < 3; i++) {
+            if (vertex_order[face[i]] < 0) {
+                vertex_order[face[i]] = next_vertex++;
+            }
+        }
+    }
+    for (int &order : vertex_order) {
+        if (order < 0) {
+            order = next_vertex++;
+        }
+    }
 
-    if (tokens.size() >= 2 && !tokens[1].empty())
-        uv = to_uint(tokens[1]);
+    std::vector<int3> sorted_faces(face_count);
+    std::vector<float3> sorted_face_normals(face_normals.size());
+    parallel_for(0, face_count, 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            auto face_id     = static_cast<int>(keys[i] & 0xFFFFFFFFu);
+            const int3 &face = faces[face_id];
+            sorted_faces[i]  = int3(vertex_order[face.x], vertex_order[face.y], vertex_order[face.z]);
+            if (!face_normals.empty()) {
+                sorted_face_normals[i] = face_normals[face_id];
+            }
+        }
+    });
+    faces.swap(sorted_faces);
+    face_normals.swap(sorted_face_normals);
 
-    if (tokens.size() >= 3 && !tokens[2].empty())
-        n = to_uint(tokens[2]);
+    std::vector<float4> sorted_vertices(vertex_count);
+    std::vector<float3> sorted_normals(normals.size());
+    parallel_for(0, vertex_count, 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            sorted_vertices[vertex_order[i]] = vertices[i];
+            if (!normals.empty()) {
+                sorted_normals[vertex_order[i]] = normals[i];
+            }
+        }
+    });
+    vertices.swap(sorted_vertices);
+    normals.swap(sorted_normals);
 }
 
 bool Model::OBJVertex::operator==(const OBJVertex &v) const { return v.p == p && v.n == n && v.uv == uv; }
 
-std::size_t Model::OBJVertexHash::operator()(const OBJVertex &v) const {
-    size_t hash = std::hash<uint32_t>()(v.p);
-    hash        = hash * 37 + std::hash<uint32_t>()(v.uv);
-    hash        = hash * 37 + std::hash<uint32_t>()(v.n);
-    return hash;
+Model::OBJVertexMap::OBJVertexMap(size_t expected_size, size_t position_count) {
+    size_t capacity = 16;
+    while (capacity < 2 * expected_size) {
+        capacity *= 2;
+    }
+    m_slots.resize(capacity);
+    m_position_count = std::max<size_t>(position_count, 1);
+}
+
+uint32_t Model::OBJVertexMap::insert(const OBJVertex &v, uint32_t new_index) {
+    size_t mask = m_slots.size() - 1;
+    for (size_t slot = home_slot(v) & mask;; slot = (slot + 1) & mask) {
+        Slot &entry = m_slots[slot];
+        if (entry.index == EmptySlot) {
+            entry.vertex = v;
+            entry.index  = new_index;
+            if (++m_size * 2 > m_slots.size()) {
+                grow();
+            }
+            return new_index;
+        }
+        if (entry.vertex == v) {
+            return entry.index;
+        }
+    }
+}
+
+size_t Model::OBJVertexMap::home_slot(const OBJVertex &v) const {
+    // Spread positions evenly over the table in file order. Neighboring faces use nearby positions, so probes stay
+    // within a few cache lines instead of jumping across the whole table. The normal and uv indices pick one of the
+    // next 8 slots, so the corners of a position which differ only in them do not all probe from the same slot.
+    size_t position    = static_cast<size_t>(static_cast<uint64_t>(v.p) * m_slots.size() / m_position_count);
+    uint32_t attribute = (v.n * 0x9E3779B1u) ^ (v.uv * 0x85EBCA6Bu);
+    return position + (attribute >> 29);
+}
+
+void Model::OBJVertexMap::grow() {
+    std::vector<Slot> slots(2 * m_slots.size());
+    std::swap(slots, m_slots);
+    size_t mask = m_slots.size() - 1;
+    for (const Slot &entry : slots) {
+        if (entry.index == EmptySlot) {
+            continue;
+        }
+        size_t slot = home_slot(entry.vertex) & mask;
+        while (m_slots[slot].index != EmptySlot) {
+            slot = (slot + 1) & mask;
+        }
+        m_slots[slot] = entry;
+    }
+}
+
+ModelStream::ModelStream(const std::string &filename, const matrix4 &model_matrix, int batch_size)
+    : m_model_matrix(model_matrix), m_normal_matrix(model_matrix.inverse().left_top_corner().transpose()),
+      m_batch_size(std::max(batch_size, 1)) {
+    MappedFile source(filename);
+    if (!source.is_open()) {
+        std::cerr << "Error opening file " << filename << std::endl;
+        return;
+    }
+
+    std::string cache_filename = filename + ".cache";
+    int64_t source_mtime       = file_mtime(filename);
+    MeshCacheHeader header{};
+    m_cache = std::make_unique<MappedFile>(cache_filename);
+    if (!m_cache->is_open() || !check_cache(*m_cache, cache_filename, source, source_mtime, header)) {
+        // The old cache has to be unmapped before it is replaced
+        m_cache.reset();
+        if (Model::build_cache(filename)) {
+            m_cache = std::make_unique<MappedFile>(cache_filename);
+        }
+        if (!m_cache || !m_cache->is_open() || !check_cache(*m_cache, cache_filename, source, source_mtime, header)) {
+            std::cerr << "Error writing mesh cache " << cache_filename << std::endl;
+            m_cache.reset();
+            return;
+        }
+    }
+
+    const auto *data = reinterpret_cast<const float3 *>(m_cache->data() + sizeof(header));
+    m_positions      = data;
+    m_normals        = header.normal_count ? data + header.vertex_count : nullptr;
+    m_faces          = reinterpret_cast<const int3 *>(data + header.vertex_count + header.normal_count);
+    m_face_count     = static_cast<int>(header.face_count);
 }
+
+ModelStream::~ModelStream() = default;
+
+bool ModelStream::is_open() const { return m_cache != nullptr; }
+
+int ModelStream::get_face_count() const { return m_face_count; }
+
+bool ModelStream::next(Model &batch) {
+    if (m_next_face >= m_face_count) {
+        return false;
+    }
+    int face_begin    = m_next_face;
+    int face_count    = std::min(m_batch_size, m_face_count - face_begin);
+    const int3 *faces = m_faces + face_begin;
+    m_next_face += face_count;
+
+    // Vertices used by the batch in index order, its faces are renumbered into them
+    m_vertex_ids.resize(3 * static_cast<size_t>(face_count));
+    memcpy(m_vertex_ids.data(), faces, sizeof(int3) * face_count);
+    std::sort(m_vertex_ids.begin(), m_vertex_ids.end());
+    m_vertex_ids.erase(std::unique(m_vertex_ids.begin(), m_vertex_ids.end()), m_vertex_ids.end());
+    int vertex_count = static_cast<int>(m_vertex_ids.size());
+
+    batch.faces.resize(face_count);
+    parallel_for(0, face_count, 1 << 16, [&](int first, int last) {
+        auto local_id = [&](int id) {
+            return static_cast<int>(std::lower_bound(m_vertex_ids.begin(), m_vertex_ids.end(), id) -
+                                    m_vertex_ids.begin());
+        };
+        for (int i = first; i < last; i++) {
+            batch.faces[i] = int3(local_id(faces[i].x), local_id(faces[i].y), local_id(faces[i].z));
+        }
+    });
+
+    m_batch_positions.resize(vertex_count);
+    m_batch_normals.resize(m_normals ? vertex_count : 0);
+    parallel_for(0, vertex_count, 1 << 16, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            m_batch_positions[i] = m_positions[m_vertex_ids[i]];
+            if (m_normals) {
+                m_batch_normals[i] = m_normals[m_vertex_ids[i]];
+            }
+        }
+    });
+    transform_attributes(m_batch_positions.data(), m_normals ? m_batch_normals.data() : nullptr, vertex_count,
+                         m_model_matrix, m_normal_matrix, batch);
+    batch.first_face_id = face_begin;
+    return true;
+}
+
+void ModelStream::rewind() { m_next_face = 0; }
@@ -0,0 +1,44 @@
+#include <core/morton.h>
+#include <core/parallel.h>
+
+void radix_sort(std::vector<uint64_t> &keys, int shift, int bit_count) {
+    constexpr int DigitBits  = 8;
+    constexpr int DigitCount = 1 << DigitBits;
+    int size                 = static_cast<int>(keys.size());
+    int chunk_count          = std::max(std::min(4 * get_thread_count(), size / (1 << 14)), 1);
+    int chunk_size           = (size + chunk_count - 1) / chunk_count;
+
+    std::vector<uint64_t> temp(size);
+    std::vector<int> offsets(chunk_count * DigitCount);
+    for (int pass_shift = shift; pass_shift < shift + bit_count; pass_shift += DigitBits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+            for (int chunk = chunk_begin; chunk < chunk_end; chunk++) {
+                int *histogram = offsets.data() + chunk * DigitCount;
+                for (int i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, size); i++) {
+                    histogram[(keys[i] >> pass_shift) & (DigitCount - 1)]++;
+                }
+            }
+        });
+
+        // Every chunk scatters its keys of one digit after those of the previous chunks
+        int sum = 0;
+        for (int digit = 0; digit < DigitCount; digit++) {
+            for (int chunk = 0; chunk < chunk_count; chunk++) {
+                int count                           = offsets[chunk * DigitCount + digit];
+                offsets[chunk * DigitCount + digit] = sum;
+                sum += count;
+            }
+        }
+
+        parallel_for(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+            for (int chunk = chunk_begin; chunk < chunk_end; chunk++) {
+                int *offset = offsets.data() + chunk * DigitCount;
+                for (int i = chunk * chunk_size; i < std::min((chunk + 1) * chunk_size, size); i++) {
+                    temp[offset[(keys[i] >> pass_shift) & (DigitCount - 1)]++] = keys[i];
+                }
+            }
+        });
+        keys.swap(temp);
+    }
+}
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <core/parallel.h>
+
+static thread_local bool t_inside_pool = false;
+
+ThreadPool::ThreadPool(int thread_count) {
+    if (thread_count <= 0) {
+        thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    for (int i = 1; i < thread_count; i++) {
+        m_workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_start_condition.notify_all();
+    for (auto &worker : m_workers) {
+        worker.join();
+    }
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool;
+    return pool;
+}
+
+int ThreadPool::get_thread_count() const { return static_cast<int>(m_workers.size()) + 1; }
+
+void ThreadPool::parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &func) {
+    if (end <= begin) {
+        return;
+    }
+    grain_size      = std::max(grain_size, 1);
+    int chunk_count = static_cast<int>((static_cast<int64_t>(end) - begin + grain_size - 1) / grain_size);
+
+    // Small jobs, single core machines and nested calls run on the calling thread
+    if (m_workers.empty() || chunk_count == 1 || t_inside_pool) {
+        for (int chunk = 0; chunk < chunk_count; chunk++) {
+            int chunk_begin = static_cast<int>(begin + static_cast<int64_t>(chunk) * grain_size);
+            int chunk_end   = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(chunk_begin) + grain_size, end));
+            func(chunk_begin, chunk_end);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> submit_lock(m_submit_mutex);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job             = &func;
+        m_job_begin       = begin;
+        m_job_end         = end;
+        m_job_grain       = grain_size;
+        m_chunk_count     = chunk_count;
+        m_pending_workers = static_cast<int>(m_workers.size());
+        m_next_chunk.store(0);
+        m_generation++;
+    }
+    m_start_condition.notify_all();
+
+    t_inside_pool = true;
+    run_chunks();
+    t_inside_pool = false;
+
+    // Workers hold func until they are done, whatever threw is rethrown on the calling thread after that
+    std::exception_ptr exception;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finish_condition.wait(lock, [this] { return m_pending_workers == 0; });
+        m_job = nullptr;
+        exception.swap(m_exception);
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+void ThreadPool::worker_loop() {
+    t_inside_pool       = true;
+    uint64_t generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start_condition.wait(lock, [&] { return m_stop || m_generation != generation; });
+            if (m_stop) {
+                return;
+            }
+            generation = m_generation;
+        }
+
+        run_chunks();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending_workers == 0) {
+                m_finish_condition.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::run_chunks() {
+    while (true) {
+        int chunk = m_next_chunk.fetch_add(1);
+        if (chunk >= m_chunk_count) {
+            break;
+        }
+        int chunk_begin = static_cast<int>(m_job_begin + static_cast<int64_t>(chunk) * m_job_grain);
+        int chunk_end =
+            static_cast<int>(std::min<int64_t>(static_cast<int64_t>(chunk_begin) + m_job_grain, m_job_end));
+        try {
+            (*m_job)(chunk_begin, chunk_end);
+        } catch (...) {
+            // Keep the first exception and skip the chunks nobody started yet
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_exception) {
+                m_exception = std::current_exception();
+            }
+            m_next_chunk.store(m_chunk_count);
+        }
+    }
+}
+
+void parallel_for(int begin, int end, int grain_size, const std::function<void(int, int)> &func) {
+    ThreadPool::global().parallel_for(begin, end, grain_size, func);
+}
+
+int get_thread_count() { return ThreadPool::global().get_thread_count(); }
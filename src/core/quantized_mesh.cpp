@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <core/quantized_mesh.h>
+
+QuantizedMesh::QuantizedMesh(const Model &model) : m_bounding_box(model.bounding_box) {
+    // Quantize positions on a 65535 step grid spanning the bounding box. Flat axes only hold zeros, their step of one
+    // keeps the position matrix invertible for the camera and the face normals of the vertex shader.
+    float3 extent = m_bounding_box.m_max_p - m_bounding_box.m_min_p;
+    auto get_step = [](float axis_extent) { return axis_extent > 0 ? axis_extent / 65535.0f : 1.0f; };
+    float3 step(get_step(extent.x), get_step(extent.y), get_step(extent.z));
+    float3 inv_step(1 / step.x, 1 / step.y, 1 / step.z);
+    m_position_matrix = matrix4::translate(m_bounding_box.m_min_p.x, m_bounding_box.m_min_p.y,
+                                           m_bounding_box.m_min_p.z) *
+                        matrix4::scale(step.x, step.y, step.z);
+
+    m_positions.resize(3 * model.vertices.size());
+    for (size_t i = 0; i < model.vertices.size(); i++) {
+        float3 offset = float3(model.vertices[i]) - m_bounding_box.m_min_p;
+        for (int axis = 0; axis < 3; axis++) {
+            float q                   = std::round(offset[axis] * inv_step[axis]);
+            m_positions[3 * i + axis] = static_cast<uint16_t>(std::clamp(q, 0.0f, 65535.0f));
+        }
+    }
+
+    m_normals.resize(model.normals.size());
+    for (size_t i = 0; i < model.normals.size(); i++) {
+        m_normals[i] = encode_normal(model.normals[i]);
+    }
+    if (model.cull_back_faces) {
+        m_face_normals.resize(model.face_normals.size());
+        for (size_t i = 0; i < model.face_normals.size(); i++) {
+            m_face_normals[i] = encode_normal(model.face_normals[i]);
+        }
+    }
+
+    if (model.vertices.size() <= 65536) {
+        m_short_faces.resize(3 * model.faces.size());
+        for (size_t i = 0; i < model.faces.size(); i++) {
+            m_short_faces[3 * i]     = static_cast<uint16_t>(model.faces[i].x);
+            m_short_faces[3 * i + 1] = static_cast<uint16_t>(model.faces[i].y);
+            m_short_faces[3 * i + 2] = static_cast<uint16_t>(model.faces[i].z);
+        }
+    } else {
+        m_faces = model.faces;
+    }
+}
+
+int QuantizedMesh::get_vertex_count() const { return static_cast<int>(m_positions.size() / 3); }
+
+int QuantizedMesh::get_face_count() const {
+    return static_cast<int>(m_faces.empty() ? m_short_faces.size() / 3 : m_faces.size());
+}
+
+bool QuantizedMesh::has_normals() const { return !m_normals.empty(); }
+
+bool QuantizedMesh::has_face_normals() const { return !m_face_normals.empty(); }
+
+const BoundingBox &QuantizedMesh::get_bounding_box() const { return m_bounding_box; }
+
+const matrix4 &QuantizedMesh::get_position_matrix() const { return m_position_matrix; }
+
+size_t QuantizedMesh::get_memory_size() const {
+    return sizeof(uint16_t) * (m_positions.size() + m_short_faces.size()) +
+           sizeof(uint32_t) * (m_normals.size() + m_face_normals.size()) + sizeof(int3) * m_faces.size();
+}
+
+uint32_t QuantizedMesh::encode_normal(const float3 &normal) {
+    // Project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the upper one
+    float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    if (length == 0.0f) {
+        length = 1.0f;
+    }
+    float u = normal.x / length;
+    float v = normal.y / length;
+    if (normal.z < 0.0f) {
+        float folded_u = (1.0f - std::abs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float folded_v = (1.0f - std::abs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u              = folded_u;
+        v              = folded_v;
+    }
+    auto quantize = [](float x) {
+        return static_cast<uint32_t>(std::clamp(std::round((x * 0.5f + 0.5f) * 65535.0f), 0.0f, 65535.0f));
+    };
+    return quantize(u) | quantize(v) << 16;
+}
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <core/rasterizer.h>
+#include <core/simd.h>
+
+// Same as std::llround(v * scale) without the library call, exact since v * scale fits the double mantissa
+static int64_t round_to_subpixel(float v, double scale) {
+    double s = static_cast<double>(v) * scale;
+    return static_cast<int64_t>(s < 0.0 ? s - 0.5 : s + 0.5);
+}
+
+bool setup_triangle(const float4 &p0, const float4 &p1, const float4 &p2, TriangleSetup &setup) {
+    constexpr double subpixel = static_cast<double>(1 << TriangleSetup::SubpixelBits);
+    constexpr int64_t half    = 1 << (TriangleSetup::SubpixelBits - 1);
+
+    // Snap vertices to the subpixel grid
+    int64_t x[3] = { round_to_subpixel(p0.x, subpixel), round_to_subpixel(p1.x, subpixel),
+                     round_to_subpixel(p2.x, subpixel) };
+    int64_t y[3] = { round_to_subpixel(p0.y, subpixel), round_to_subpixel(p1.y, subpixel),
+                     round_to_subpixel(p2.y, subpixel) };
+    float z[3]   = { p0.z, p1.z, p2.z };
+
+    int64_t a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        int k = (i + 2) % 3;
+        a[i]  = y[j] - y[k];
+        b[i]  = x[k] - x[j];
+        c[i]  = -(a[i] * x[j] + b[i] * y[j]);
+    }
+
+    int64_t area = a[0] * x[0] + b[0] * y[0] + c[0];
+    if (area == 0) {
+        return false;
+    }
+    if (area < 0) { // Make the inside positive whatever the winding
+        for (int i = 0; i < 3; i++) {
+            a[i] = -a[i];
+            b[i] = -b[i];
+            c[i] = -c[i];
+        }
+        area = -area;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        // Top-left fill rule, pixels on the other edges are left to the neighbour triangle
+        int64_t bias      = a[i] > 0 || (a[i] == 0 && b[i] > 0) ? 0 : -1;
+        setup.e_origin[i] = (a[i] + b[i]) * half + c[i] + bias;
+        setup.e_dx[i]     = a[i] * (1 << TriangleSetup::SubpixelBits);
+        setup.e_dy[i]     = b[i] * (1 << TriangleSetup::SubpixelBits);
+    }
+    setup.inv_area = 1.0f / static_cast<float>(area);
+
+    setup.min_x = static_cast<int>(std::floor(std::min(std::min(p0.x, p1.x), p2.x)));
+    setup.max_x = static_cast<int>(std::ceil(std::max(std::max(p0.x, p1.x), p2.x)));
+    setup.min_y = static_cast<int>(std::floor(std::min(std::min(p0.y, p1.y), p2.y)));
+    setup.max_y = static_cast<int>(std::ceil(std::max(std::max(p0.y, p1.y), p2.y)));
+
+    // Depth plane through the snapped vertices, relative to the bounding box corner to keep the terms small
+    double dx1   = static_cast<double>(x[1] - x[0]) / subpixel;
+    double dy1   = static_cast<double>(y[1] - y[0]) / subpixel;
+    double dx2   = static_cast<double>(x[2] - x[0]) / subpixel;
+    double dy2   = static_cast<double>(y[2] - y[0]) / subpixel;
+    double dz1   = static_cast<double>(z[1]) - z[0];
+    double dz2   = static_cast<double>(z[2]) - z[0];
+    double det   = dx1 * dy2 - dx2 * dy1;
+    double z_dx  = (dz1 * dy2 - dz2 * dy1) / det;
+    double z_dy  = (dx1 * dz2 - dx2 * dz1) / det;
+    setup.x_ref  = setup.min_x;
+    setup.y_ref  = setup.min_y;
+    setup.z_dx   = static_cast<float>(z_dx);
+    setup.z_dy   = static_cast<float>(z_dy);
+    setup.z_ref  = static_cast<float>(z[0] + z_dx * (setup.x_ref + 0.5 - static_cast<double>(x[0]) / subpixel) +
+                                     z_dy * (setup.y_ref + 0.5 - static_cast<double>(y[0]) / subpixel));
+    return true;
+}
+
+static void rasterize_depth_scalar(const TriangleSetup &setup, int tri_id, int min_x, int max_x, int min_y, int max_y,
+                                   float *depth_buffer, int *triangle_id_buffer, int row_stride) {
+    rasterize_triangle(setup, min_x, max_x, min_y, max_y, [&](int x, int y, float depth) {
+        int64_t idx = static_cast<int64_t>(y) * row_stride + x;
+        if (depth < depth_buffer[idx] || (depth == depth_buffer[idx] && tri_id < triangle_id_buffer[idx])) {
+            depth_buffer[idx]       = depth;
+            triangle_id_buffer[idx] = tri_id;
+        }
+    });
+}
+
+#if defined(M_SIMD_X86)
+M_TARGET("sse4.1")
+static void rasterize_depth_sse41(const TriangleSetup &setup, int tri_id, int min_x, int max_x, int min_y, int max_y,
+                                  float *depth_buffer, int *triangle_id_buffer, int row_stride) {
+    // Each edge needs two registers of 64 bit lanes for 4 pixels
+    __m128i step_lo[3], step_hi[3], step4[3];
+    for (int i = 0; i < 3; i++) {
+        int64_t dx = setup.e_dx[i];
+        step_lo[i] = _mm_set_epi64x(dx, 0);
+        step_hi[i] = _mm_set_epi64x(3 * dx, 2 * dx);
+        step4[i]   = _mm_set1_epi64x(4 * dx);
+    }
+    const __m128 lane_fx   = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128 z_dx      = _mm_set1_ps(setup.z_dx);
+    const __m128i tri      = _mm_set1_epi32(tri_id);
+    const __m128i all_ones = _mm_set1_epi32(-1);
+
+    int64_t row[3] = { setup.edge(0, min_x, min_y), setup.edge(1, min_x, min_y), setup.edge(2, min_x, min_y) };
+    float fy       = static_cast<float>(min_y - setup.y_ref);
+    int block_end  = max_x - 3; // Last x which starts a full block
+
+    for (int y = min_y; y <= max_y; y++) {
+        __m128i e_lo[3], e_hi[3];
+        for (int i = 0; i < 3; i++) {
+            e_lo[i] = _mm_add_epi64(_mm_set1_epi64x(row[i]), step_lo[i]);
+            e_hi[i] = _mm_add_epi64(_mm_set1_epi64x(row[i]), step_hi[i]);
+        }
+        float z_row    = setup.z_ref + setup.z_dy * fy;
+        __m128 z_row_v = _mm_set1_ps(z_row);
+        float *depth   = depth_buffer + static_cast<int64_t>(y) * row_stride;
+        int *triangle  = triangle_id_buffer + static_cast<int64_t>(y) * row_stride;
+
+        int x = min_x;
+        for (; x <= block_end; x += 4) {
+            __m128i or_lo = _mm_or_si128(_mm_or_si128(e_lo[0], e_lo[1]), e_lo[2]);
+            __m128i or_hi = _mm_or_si128(_mm_or_si128(e_hi[0], e_hi[1]), e_hi[2]);
+            // The high 32 bits of each 64 bit lane carry its sign
+            __m128i signs  = _mm_castps_si128(
+                _mm_shuffle_ps(_mm_castsi128_ps(or_lo), _mm_castsi128_ps(or_hi), _MM_SHUFFLE(3, 1, 3, 1)));
+            __m128i inside = _mm_cmpgt_epi32(signs, all_ones);
+            if (_mm_movemask_epi8(inside) != 0) {
+                __m128 fx       = _mm_add_ps(_mm_set1_ps(static_cast<float>(x - setup.x_ref)), lane_fx);
+                __m128 z        = _mm_add_ps(z_row_v, _mm_mul_ps(z_dx, fx));
+                __m128 old_z    = _mm_loadu_ps(depth + x);
+                __m128i old_id  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(triangle + x));
+                __m128 tie      = _mm_and_ps(_mm_cmpeq_ps(z, old_z), _mm_castsi128_ps(_mm_cmpgt_epi32(old_id, tri)));
+                __m128 write    = _mm_and_ps(_mm_castsi128_ps(inside), _mm_or_ps(_mm_cmplt_ps(z, old_z), tie));
+                if (_mm_movemask_ps(write) != 0) {
+                    _mm_storeu_ps(depth + x, _mm_blendv_ps(old_z, z, write));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(triangle + x),
+                                     _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(old_id),
+                                                                    _mm_castsi128_ps(tri), write)));
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                e_lo[i] = _mm_add_epi64(e_lo[i], step4[i]);
+                e_hi[i] = _mm_add_epi64(e_hi[i], step4[i]);
+            }
+        }
+
+        // Remaining pixels of the row
+        int64_t e0 = row[0] + setup.e_dx[0] * (x - min_x);
+        int64_t e1 = row[1] + setup.e_dx[1] * (x - min_x);
+        int64_t e2 = row[2] + setup.e_dx[2] * (x - min_x);
+        for (; x <= max_x; x++) {
+            if ((e0 | e1 | e2) >= 0) {
+                float z = z_row + setup.z_dx * static_cast<float>(x - setup.x_ref);
+                if (z < depth[x] || (z == depth[x] && tri_id < triangle[x])) {
+                    depth[x]    = z;
+                    triangle[x] = tri_id;
+                }
+            }
+            e0 += setup.e_dx[0];
+            e1 += setup.e_dx[1];
+            e2 += setup.e_dx[2];
+        }
+
+        for (int i = 0; i < 3; i++) {
+            row[i] += setup.e_dy[i];
+        }
+        fy += 1.0f;
+    }
+}
+
+M_TARGET("avx2")
+static void rasterize_depth_avx2(const TriangleSetup &setup, int tri_id, int min_x, int max_x, int min_y, int max_y,
+                                 float *depth_buffer, int *triangle_id_buffer, int row_stride) {
+    // Each edge needs two registers of 64 bit lanes for 8 pixels
+    __m256i step_lo[3], step_hi[3], step8[3];
+    for (int i = 0; i < 3; i++) {
+        int64_t dx = setup.e_dx[i];
+        step_lo[i] = _mm256_setr_epi64x(0, dx, 2 * dx, 3 * dx);
+        step_hi[i] = _mm256_setr_epi64x(4 * dx, 5 * dx, 6 * dx, 7 * dx);
+        step8[i]   = _mm256_set1_epi64x(8 * dx);
+    }
+    const __m256 lane_fx    = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const __m256i lane      = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i high_half = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+    const __m256 z_dx       = _mm256_set1_ps(setup.z_dx);
+    const __m256i tri       = _mm256_set1_epi32(tri_id);
+    const __m256i all_ones  = _mm256_set1_epi32(-1);
+
+    int64_t row[3] = { setup.edge(0, min_x, min_y), setup.edge(1, min_x, min_y), setup.edge(2, min_x, min_y) };
+    float fy       = static_cast<float>(min_y - setup.y_ref);
+
+    for (int y = min_y; y <= max_y; y++) {
+        __m256i e_lo[3], e_hi[3];
+        for (int i = 0; i < 3; i++) {
+            e_lo[i] = _mm256_add_epi64(_mm256_set1_epi64x(row[i]), step_lo[i]);
+            e_hi[i] = _mm256_add_epi64(_mm256_set1_epi64x(row[i]), step_hi[i]);
+        }
+        __m256 z_row  = _mm256_set1_ps(setup.z_ref + setup.z_dy * fy);
+        float *depth  = depth_buffer + static_cast<int64_t>(y) * row_stride;
+        int *triangle = triangle_id_buffer + static_cast<int64_t>(y) * row_stride;
+
+        for (int x = min_x; x <= max_x; x += 8) {
+            __m256i or_lo = _mm256_or_si256(_mm256_or_si256(e_lo[0], e_lo[1]), e_lo[2]);
+            __m256i or_hi = _mm256_or_si256(_mm256_or_si256(e_hi[0], e_hi[1]), e_hi[2]);
+            // Gather the high 32 bits of each 64 bit lane, they carry its sign
+            __m256i signs = _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(or_lo, high_half),
+                                                      _mm256_permutevar8x32_epi32(or_hi, high_half), 0x20);
+            // Lanes past max_x are masked out, masked loads and stores do not touch them
+            __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(max_x - x + 1), lane);
+            __m256i mask  = _mm256_and_si256(_mm256_cmpgt_epi32(signs, all_ones), valid);
+            if (!_mm256_testz_si256(mask, mask)) {
+                __m256 fx    = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x - setup.x_ref)), lane_fx);
+                __m256 z     = _mm256_add_ps(z_row, _mm256_mul_ps(z_dx, fx));
+                __m256 old_z   = _mm256_maskload_ps(depth + x, mask);
+                __m256i old_id = _mm256_maskload_epi32(triangle + x, mask);
+                __m256i tie    = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(z, old_z, _CMP_EQ_OQ)),
+                                                  _mm256_cmpgt_epi32(old_id, tri));
+                __m256i write  = _mm256_and_si256(
+                    mask, _mm256_or_si256(_mm256_castps_si256(_mm256_cmp_ps(z, old_z, _CMP_LT_OQ)), tie));
+                if (!_mm256_testz_si256(write, write)) {
+                    _mm256_maskstore_ps(depth + x, write, z);
+                    _mm256_maskstore_epi32(triangle + x, write, tri);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                e_lo[i] = _mm256_add_epi64(e_lo[i], step8[i]);
+                e_hi[i] = _mm256_add_epi64(e_hi[i], step8[i]);
+            }
+        }
+
+        for (int i = 0; i < 3; i++) {
+            row[i] += setup.e_dy[i];
+        }
+        fy += 1.0f;
+    }
+}
+#endif
+
+void rasterize_depth(const TriangleSetup &setup, int tri_id, int min_x, int max_x, int min_y, int max_y,
+                     float *depth_buffer, int *triangle_id_buffer, int row_stride) {
+    if (min_x > max_x || min_y > max_y) {
+        return;
+    }
+#if defined(M_SIMD_X86)
+    switch (get_simd_level()) {
+        case EAVX2:
+            rasterize_depth_avx2(setup, tri_id, min_x, max_x, min_y, max_y, depth_buffer, triangle_id_buffer,
+                                 row_stride);
+            return;
+        case ESSE41:
+            rasterize_depth_sse41(setup, tri_id, min_x, max_x, min_y, max_y, depth_buffer, triangle_id_buffer,
+                                  row_stride);
+            return;
+        default:
+            break;
+    }
+#endif
+    rasterize_depth_scalar(setup, tri_id, min_x, max_x, min_y, max_y, depth_buffer, triangle_id_buffer, row_stride);
+}
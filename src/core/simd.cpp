@@ -0,0 +1,44 @@
+#include <algorithm>
+#include <core/simd.h>
+#if defined(_MSC_VER) && defined(M_SIMD_X86)
+#include <intrin.h>
+#endif
+
+static SimdLevel detect_simd_level() {
+#if defined(M_SIMD_X86)
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool sse41   = (info[2] & 1 << 19) != 0;
+    bool osxsave = (info[2] & 1 << 27) != 0;
+    bool avx     = (info[2] & 1 << 28) != 0;
+    bool avx2    = false;
+    if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & 1 << 5) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool sse41 = __builtin_cpu_supports("sse4.1");
+    bool avx2  = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2) {
+        return EAVX2;
+    }
+    if (sse41) {
+        return ESSE41;
+    }
+#endif
+    return EScalar;
+}
+
+static SimdLevel &current_simd_level() {
+    static SimdLevel level = detect_simd_level();
+    return level;
+}
+
+SimdLevel get_simd_level() { return current_simd_level(); }
+
+void set_simd_level(SimdLevel level) { current_simd_level() = std::min(level, detect_simd_level()); }
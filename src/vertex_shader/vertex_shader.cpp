@@ -1,32 +1,592 @@
 #include <vertex_shader/vertex_shader.h>
 #include <algorithm>
+#include <core/parallel.h>
+#include <core/simd.h>
+#include <cstring>
+
+// Outcode bits of a clip space vertex. They are tested before the divide, so they hold behind the camera too.
+static constexpr uint8_t OutsideMinX      = 1;
+static constexpr uint8_t OutsideMaxX      = 2;
+static constexpr uint8_t OutsideMinY      = 4;
+static constexpr uint8_t OutsideMaxY      = 8;
+static constexpr uint8_t OutsideNear      = 16;
+static constexpr uint8_t OutsideGuardBand = 32;
+static constexpr uint8_t OutsideScreen    = OutsideMinX | OutsideMaxX | OutsideMinY | OutsideMaxY;
+
+// Pixels past each side of the screen that are rasterized without clipping, the engines scissor to the screen. The
+// fixed point edge functions and the scanline spans stay exact up to there.
+static constexpr float GuardBand = 16384.0f;
+
+// NaN coordinates compare false and stay on screen, the wide paths keep that
+static uint8_t get_outcode(const float4 &p, float width, float height) {
+    uint8_t outcode = 0;
+    outcode |= p.x < 0.0f ? OutsideMinX : 0;
+    outcode |= p.x >= width * p.w ? OutsideMaxX : 0;
+    outcode |= p.y < 0.0f ? OutsideMinY : 0;
+    outcode |= p.y >= height * p.w ? OutsideMaxY : 0;
+    outcode |= p.z < 0.0f ? OutsideNear : 0;
+    if (p.x < -GuardBand * p.w || p.x > (width + GuardBand) * p.w || p.y < -GuardBand * p.w ||
+        p.y > (height + GuardBand) * p.w) {
+        outcode |= OutsideGuardBand;
+    }
+    return outcode;
+}
+
+// Vertex index of float positions or of 16 bit quantized ones, three per vertex. Quantized positions are exact in
+// floats and get a w of one like the float ones, so both give the same bits through the same matrix.
+static const float4 &load_vertex(const float4 *input, int index) { return input[index]; }
+
+static float4 load_vertex(const uint16_t *input, int index) {
+    const uint16_t *position = input + 3 * index;
+    return float4(position[0], position[1], position[2], 1.0f);
+}
+
+template <typename Input>
+static void transform_vertices_scalar(const matrix4 &matrix, const Input *input, float4 *output, uint8_t *outcodes,
+                                      int begin, int end, float width, float height) {
+    for (int i = begin; i < end; i++) {
+        float4 vertex = matrix * load_vertex(input, i);
+        outcodes[i]   = get_outcode(vertex, width, height);
+        vertex /= vertex.w;
+        output[i] = vertex;
+    }
+}
+
+#if defined(M_SIMD_X86)
+// Set bit in the outcodes of the lanes where mask is true
+M_TARGET("sse4.1")
+static __m128i set_outcode_bit(__m128i outcode, __m128 mask, uint8_t bit) {
+    return _mm_or_si128(outcode, _mm_and_si128(_mm_castps_si128(mask), _mm_set1_epi32(bit)));
+}
+
+// Four vertices from index on, transposed into x, y, z and w registers
+M_TARGET("sse4.1")
+static void load_vertices_sse41(const float4 *input, int index, __m128 v[4]) {
+    const auto *data = reinterpret_cast<const float *>(input + index);
+    for (int k = 0; k < 4; k++) {
+        v[k] = _mm_loadu_ps(data + 4 * k);
+    }
+    _MM_TRANSPOSE4_PS(v[0], v[1], v[2], v[3]);
+}
+
+// The 24 bytes of four quantized positions are loaded without reading past them, then every axis is shuffled out of
+// both loads with its 16 bit values zero extended to 32 bit lanes
+M_TARGET("sse4.1")
+static void load_vertices_sse41(const uint16_t *input, int index, __m128 v[4]) {
+    const uint16_t *data = input + 3 * index;
+    __m128i low          = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    __m128i high         = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(data + 8));
+
+    // Bytes of the x, y and z values of every vertex in low and high, -1 zeroes a byte
+    const __m128i low_masks[3]  = { _mm_setr_epi8(0, 1, -1, -1, 6, 7, -1, -1, 12, 13, -1, -1, -1, -1, -1, -1),
+                                    _mm_setr_epi8(2, 3, -1, -1, 8, 9, -1, -1, 14, 15, -1, -1, -1, -1, -1, -1),
+                                    _mm_setr_epi8(4, 5, -1, -1, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) };
+    const __m128i high_masks[3] = { _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, -1, -1),
+                                    _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, -1, -1),
+                                    _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, -1, 6, 7, -1, -1) };
+    for (int axis = 0; axis < 3; axis++) {
+        __m128i lanes = _mm_or_si128(_mm_shuffle_epi8(low, low_masks[axis]), _mm_shuffle_epi8(high, high_masks[axis]));
+        v[axis]       = _mm_cvtepi32_ps(lanes);
+    }
+    v[3] = _mm_set1_ps(1.0f);
+}
+
+// Returns the index the vertices are done up to, the rest is left to the scalar path
+template <typename Input>
+M_TARGET("sse4.1")
+static int transform_vertices_sse41(const matrix4 &matrix, const Input *input, float4 *output, uint8_t *outcodes,
+                                    int begin, int end, float width, float height) {
+    __m128 m[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            m[row][col] = _mm_set1_ps(matrix.data[row][col]);
+        }
+    }
+    const __m128 zero      = _mm_setzero_ps();
+    const __m128 max_x     = _mm_set1_ps(width);
+    const __m128 max_y     = _mm_set1_ps(height);
+    const __m128 guard_min = _mm_set1_ps(-GuardBand);
+    const __m128 guard_x   = _mm_set1_ps(width + GuardBand);
+    const __m128 guard_y   = _mm_set1_ps(height + GuardBand);
+    auto *output_data      = reinterpret_cast<float *>(output);
+
+    int i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 v[4];
+        load_vertices_sse41(input, i, v);
+
+        // Same order of operations as matrix4 * float4, so every path gives the same bits
+        __m128 r[4];
+        for (int row = 0; row < 4; row++) {
+            __m128 sum = _mm_add_ps(zero, _mm_mul_ps(m[row][0], v[0]));
+            sum        = _mm_add_ps(sum, _mm_mul_ps(m[row][1], v[1]));
+            sum        = _mm_add_ps(sum, _mm_mul_ps(m[row][2], v[2]));
+            r[row]     = _mm_add_ps(sum, _mm_mul_ps(m[row][3], v[3]));
+        }
+        __m128 w = r[3];
+
+        // Outcodes are built in 32 bit lanes and narrowed to one byte per vertex
+        __m128 min_w    = _mm_mul_ps(guard_min, w);
+        __m128 max_x_w  = _mm_mul_ps(max_x, w);
+        __m128 max_y_w  = _mm_mul_ps(max_y, w);
+        __m128 off_x    = _mm_or_ps(_mm_cmplt_ps(r[0], min_w), _mm_cmpgt_ps(r[0], _mm_mul_ps(guard_x, w)));
+        __m128 off_y    = _mm_or_ps(_mm_cmplt_ps(r[1], min_w), _mm_cmpgt_ps(r[1], _mm_mul_ps(guard_y, w)));
+        __m128i outcode = _mm_setzero_si128();
+        outcode         = set_outcode_bit(outcode, _mm_cmplt_ps(r[0], zero), OutsideMinX);
+        outcode         = set_outcode_bit(outcode, _mm_cmpge_ps(r[0], max_x_w), OutsideMaxX);
+        outcode         = set_outcode_bit(outcode, _mm_cmplt_ps(r[1], zero), OutsideMinY);
+        outcode         = set_outcode_bit(outcode, _mm_cmpge_ps(r[1], max_y_w), OutsideMaxY);
+        outcode         = set_outcode_bit(outcode, _mm_cmplt_ps(r[2], zero), OutsideNear);
+        outcode         = set_outcode_bit(outcode, _mm_or_ps(off_x, off_y), OutsideGuardBand);
+        outcode         = _mm_packus_epi16(_mm_packus_epi32(outcode, outcode), outcode);
+        int packed      = _mm_cvtsi128_si32(outcode);
+        std::memcpy(outcodes + i, &packed, 4);
+
+        r[0] = _mm_div_ps(r[0], w);
+        r[1] = _mm_div_ps(r[1], w);
+        r[2] = _mm_div_ps(r[2], w);
+        r[3] = _mm_div_ps(w, w);
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_ps(output_data + 4 * (i + k), r[k]);
+        }
+    }
+    return i;
+}
+
+M_TARGET("avx2")
+static __m256i set_outcode_bit(__m256i outcode, __m256 mask, uint8_t bit) {
+    return _mm256_or_si256(outcode, _mm256_and_si256(_mm256_castps_si256(mask), _mm256_set1_epi32(bit)));
+}
+
+// Transpose the 4x4 blocks in both 128 bit halves
+M_TARGET("avx2")
+static void transpose_avx2(__m256 &v0, __m256 &v1, __m256 &v2, __m256 &v3) {
+    __m256 t0 = _mm256_unpacklo_ps(v0, v1);
+    __m256 t1 = _mm256_unpacklo_ps(v2, v3);
+    __m256 t2 = _mm256_unpackhi_ps(v0, v1);
+    __m256 t3 = _mm256_unpackhi_ps(v2, v3);
+    v0        = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+    v1        = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+    v2        = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    v3        = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// Eight vertices from index on, lane j of x, y, z and w belongs to vertex index + j
+M_TARGET("avx2")
+static void load_vertices_avx2(const float4 *input, int index, __m256 v[4]) {
+    // Vertices k and k + 4 share a register until the transpose
+    const auto *data = reinterpret_cast<const float *>(input + index);
+    for (int k = 0; k < 4; k++) {
+        v[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(data + 4 * k)), _mm_loadu_ps(data + 4 * k + 16),
+                                    1);
+    }
+    transpose_avx2(v[0], v[1], v[2], v[3]);
+}
+
+M_TARGET("avx2")
+static void load_vertices_avx2(const uint16_t *input, int index, __m256 v[4]) {
+    __m128 low[4], high[4];
+    load_vertices_sse41(input, index, low);
+    load_vertices_sse41(input, index + 4, high);
+    for (int k = 0; k < 4; k++) {
+        v[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(low[k]), high[k], 1);
+    }
+}
+
+template <typename Input>
+M_TARGET("avx2")
+static int transform_vertices_avx2(const matrix4 &matrix, const Input *input, float4 *output, uint8_t *outcodes,
+                                   int begin, int end, float width, float height) {
+    __m256 m[4][4];
+    for (int row = 0; row < 4; row++) {
+        for (int col = 0; col < 4; col++) {
+            m[row][col] = _mm256_set1_ps(matrix.data[row][col]);
+        }
+    }
+    const __m256 zero      = _mm256_setzero_ps();
+    const __m256 max_x     = _mm256_set1_ps(width);
+    const __m256 max_y     = _mm256_set1_ps(height);
+    const __m256 guard_min = _mm256_set1_ps(-GuardBand);
+    const __m256 guard_x   = _mm256_set1_ps(width + GuardBand);
+    const __m256 guard_y   = _mm256_set1_ps(height + GuardBand);
+    auto *output_data      = reinterpret_cast<float *>(output);
+
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 v[4];
+        load_vertices_avx2(input, i, v);
+
+        __m256 r[4];
+        for (int row = 0; row < 4; row++) {
+            __m256 sum = _mm256_add_ps(zero, _mm256_mul_ps(m[row][0], v[0]));
+            sum        = _mm256_add_ps(sum, _mm256_mul_ps(m[row][1], v[1]));
+            sum        = _mm256_add_ps(sum, _mm256_mul_ps(m[row][2], v[2]));
+            r[row]     = _mm256_add_ps(sum, _mm256_mul_ps(m[row][3], v[3]));
+        }
+        __m256 w = r[3];
+
+        __m256 min_w    = _mm256_mul_ps(guard_min, w);
+        __m256 max_x_w  = _mm256_mul_ps(max_x, w);
+        __m256 max_y_w  = _mm256_mul_ps(max_y, w);
+        __m256 off_x    = _mm256_or_ps(_mm256_cmp_ps(r[0], min_w, _CMP_LT_OQ),
+                                       _mm256_cmp_ps(r[0], _mm256_mul_ps(guard_x, w), _CMP_GT_OQ));
+        __m256 off_y    = _mm256_or_ps(_mm256_cmp_ps(r[1], min_w, _CMP_LT_OQ),
+                                       _mm256_cmp_ps(r[1], _mm256_mul_ps(guard_y, w), _CMP_GT_OQ));
+        __m256i outcode = _mm256_setzero_si256();
+        outcode         = set_outcode_bit(outcode, _mm256_cmp_ps(r[0], zero, _CMP_LT_OQ), OutsideMinX);
+        outcode         = set_outcode_bit(outcode, _mm256_cmp_ps(r[0], max_x_w, _CMP_GE_OQ), OutsideMaxX);
+        outcode         = set_outcode_bit(outcode, _mm256_cmp_ps(r[1], zero, _CMP_LT_OQ), OutsideMinY);
+        outcode         = set_outcode_bit(outcode, _mm256_cmp_ps(r[1], max_y_w, _CMP_GE_OQ), OutsideMaxY);
+        outcode         = set_outcode_bit(outcode, _mm256_cmp_ps(r[2], zero, _CMP_LT_OQ), OutsideNear);
+        outcode         = set_outcode_bit(outcode, _mm256_or_ps(off_x, off_y), OutsideGuardBand);
+        __m128i narrow  = _mm_packus_epi32(_mm256_castsi256_si128(outcode), _mm256_extracti128_si256(outcode, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(outcodes + i), _mm_packus_epi16(narrow, narrow));
+
+        r[0] = _mm256_div_ps(r[0], w);
+        r[1] = _mm256_div_ps(r[1], w);
+        r[2] = _mm256_div_ps(r[2], w);
+        r[3] = _mm256_div_ps(w, w);
+        transpose_avx2(r[0], r[1], r[2], r[3]);
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_ps(output_data + 4 * (i + k), _mm256_castps256_ps128(r[k]));
+            _mm_storeu_ps(output_data + 4 * (i + k + 4), _mm256_extractf128_ps(r[k], 1));
+        }
+    }
+    return i;
+}
+#endif
+
+// Passed as the face normals of models which keep their back faces
+static const std::vector<float3> NoFaceNormals;
+
+// Scratch of shade and of decoding quantized instances. It is kept per thread and only grows, so drawing instances
+// stops allocating once it fits the largest mesh.
+static thread_local std::vector<uint8_t> t_outcodes;
+static thread_local std::vector<int> t_clipped;
+static thread_local std::vector<float3> t_face_normals;
+
+// Meshes shade reads, float vertices with int faces
+struct FloatMeshView {
+    const std::vector<float4> &vertices;
+    const std::vector<int3> &faces;
+
+    [[nodiscard]] int get_vertex_count() const { return static_cast<int>(vertices.size()); }
+
+    [[nodiscard]] int get_face_count() const { return static_cast<int>(faces.size()); }
+
+    [[nodiscard]] const float4 *get_positions() const { return vertices.data(); }
+
+    [[nodiscard]] const float4 &get_position(int index) const { return vertices[index]; }
+
+    [[nodiscard]] const int3 &get_face(int index) const { return faces[index]; }
+};
+
+// or the 16 bit positions and faces of a QuantizedMesh as they are stored, its position matrix goes into the transform
+struct QuantizedMeshView {
+    const QuantizedMesh &mesh;
+
+    [[nodiscard]] int get_vertex_count() const { return mesh.get_vertex_count(); }
+
+    [[nodiscard]] int get_face_count() const { return mesh.get_face_count(); }
+
+    [[nodiscard]] const uint16_t *get_positions() const { return mesh.get_position(0); }
+
+    [[nodiscard]] float4 get_position(int index) const { return load_vertex(get_positions(), index); }
+
+    [[nodiscard]] int3 get_face(int index) const { return mesh.get_face(index); }
+};
+
+// Vertex of a polygon being clipped, index is -1 for the ones made by clipping
+struct ClipVertex {
+    float4 position;
+    float3 normal;
+    int index;
+};
 
 VertexShader::VertexShader(const matrix4 &view_matrix, const matrix4 &perspective_matrix, const matrix4 &screen_matrix,
                            int width, int height)
     : m_view_matrix(view_matrix), m_perspective_matrix(perspective_matrix), m_screen_matrix(screen_matrix),
       m_width(width), m_height(height) {
     m_transform_matrix = m_screen_matrix * m_perspective_matrix * m_view_matrix;
+    m_camera_position  = float3(m_view_matrix.inverse() * float4(0.0f, 0.0f, 0.0f, 1.0f));
 }
 
 void VertexShader::apply(const std::shared_ptr<Model> &model) const {
-    for (auto &vertex : model->vertices) {
-        vertex = m_transform_matrix * vertex;
-        vertex /= vertex.w;
+    // The world space vertices and faces move out of the model, which receives the screen space ones
+    std::vector<float4> vertices;
+    std::vector<int3> faces;
+    std::vector<float3> face_normals;
+    vertices.swap(model->vertices);
+    faces.swap(model->faces);
+    face_normals.swap(model->face_normals);
+    if (!model->cull_back_faces) {
+        face_normals.clear();
+    }
+    model->source_normals = nullptr;
+    shade(m_transform_matrix, FloatMeshView{ vertices, faces }, face_normals, m_camera_position, *model);
+}
+
+void VertexShader::apply(const Model &model, const std::shared_ptr<Model> &output) const {
+    // Normals stay in world space and are read from model, output only stores those of vertices made by clipping
+    output->face_normals.clear();
+    output->normals.clear();
+    output->source_normals = &model.normals;
+    output->bounding_box   = model.bounding_box;
+    output->first_face_id  = model.first_face_id;
+    shade(m_transform_matrix, FloatMeshView{ model.vertices, model.faces },
+          model.cull_back_faces ? model.face_normals : NoFaceNormals, m_camera_position, *output);
+}
+
+void VertexShader::apply(const Instance &instance, const std::shared_ptr<Model> &output) const {
+    matrix4 transform_matrix = m_transform_matrix * instance.get_model_matrix();
+    output->faces.clear();
+    output->face_normals.clear();
+    output->source_normals = nullptr;
+    output->bounding_box   = BoundingBox();
+
+    // Instances whose bounding box corners are all past one side of the screen or behind the near plane have no faces
+    // left after culling, skip them without touching their vertices
+    const BoundingBox &bbox = instance.get_bounding_box();
+    auto width              = static_cast<float>(m_width);
+    auto height             = static_cast<float>(m_height);
+    uint8_t corner_outcode  = OutsideScreen | OutsideNear;
+    for (int corner = 0; corner < 8; corner++) {
+        float4 p(corner & 1 ? bbox.m_max_p.x : bbox.m_min_p.x, corner & 2 ? bbox.m_max_p.y : bbox.m_min_p.y,
+                 corner & 4 ? bbox.m_max_p.z : bbox.m_min_p.z, 1.0f);
+        corner_outcode &= get_outcode(transform_matrix * p, width, height);
+    }
+    if (corner_outcode != 0) {
+        output->vertices.clear();
+        output->normals.clear();
+        return;
     }
 
-    // Cull triangles
-    auto is_outside_screen = [&](const int3 &face) {
-        for (int i = 0; i < 3; i++) {
-            const float4 &vertex = model->vertices[face[i]];
-            if (vertex.x < 0.0f || vertex.x >= static_cast<float>(m_width) || vertex.y < 0.0f ||
-                vertex.y >= static_cast<float>(m_height)) {
-                return true; // Should be removed
+    // Back faces are found in the space of the mesh, the camera is moved there instead of every face normal out of it
+    auto get_camera = [&](const matrix4 &matrix) {
+        return float3(matrix.inverse() * float4(m_camera_position.x, m_camera_position.y, m_camera_position.z, 1.0f));
+    };
+
+    // Every vertex of the mesh is transformed once per instance
+    const matrix3 &normal_matrix = instance.get_normal_matrix();
+    if (const auto &mesh = instance.get_mesh()) {
+        output->normals.resize(mesh->normals.size());
+        for (size_t i = 0; i < mesh->normals.size(); i++) {
+            output->normals[i] = (normal_matrix * mesh->normals[i]).normalize();
+        }
+        FloatMeshView view{ mesh->vertices, mesh->faces };
+        if (mesh->cull_back_faces) {
+            shade(transform_matrix, view, mesh->face_normals, get_camera(instance.get_model_matrix()), *output);
+        } else {
+            shade(transform_matrix, view, NoFaceNormals, m_camera_position, *output);
+        }
+    } else {
+        // Dequantization is folded into the transform, which reads the 16 bit positions as they are
+        const QuantizedMesh &quantized = *instance.get_quantized_mesh();
+        int vertex_count               = quantized.get_vertex_count();
+        int face_count                 = quantized.get_face_count();
+        int normal_count = quantized.has_normals() ? vertex_count : 0;
+        output->normals.resize(normal_count);
+        for (int i = 0; i < normal_count; i++) {
+            output->normals[i] = (normal_matrix * quantized.get_normal(i)).normalize();
+        }
+
+        // Planes keep their side when face normals go to quantized space by the transposed position matrix
+        float3 camera = m_camera_position;
+        t_face_normals.clear();
+        if (quantized.has_face_normals()) {
+            matrix3 face_normal_matrix = quantized.get_position_matrix().left_top_corner().transpose();
+            t_face_normals.resize(face_count);
+            for (int i = 0; i < face_count; i++) {
+                t_face_normals[i] = face_normal_matrix * quantized.get_face_normal(i);
             }
+            camera = get_camera(instance.get_model_matrix() * quantized.get_position_matrix());
+        }
+        shade(transform_matrix * quantized.get_position_matrix(), QuantizedMeshView{ quantized }, t_face_normals,
+              camera, *output);
+    }
+}
+
+template <typename Mesh>
+void VertexShader::shade(const matrix4 &matrix, const Mesh &mesh, const std::vector<float3> &face_normals,
+                         const float3 &camera, Model &output) const {
+    int vertex_count = mesh.get_vertex_count();
+    t_outcodes.resize(vertex_count);
+    output.vertices.resize(vertex_count);
+    transform(matrix, mesh.get_positions(), output.vertices.data(), t_outcodes.data(), vertex_count);
+
+    // Accepted faces keep their order and come first, so triangle ids are the same for every engine
+    cull(mesh, face_normals, camera, t_outcodes, output.faces, t_clipped);
+    for (int i : t_clipped) {
+        clip(matrix, mesh, mesh.get_face(i), t_outcodes, output);
+    }
+}
+
+template <typename Input>
+void VertexShader::transform(const matrix4 &matrix, const Input *input, float4 *output, uint8_t *outcodes,
+                             int count) const {
+    auto width           = static_cast<float>(m_width);
+    auto height          = static_cast<float>(m_height);
+    SimdLevel simd_level = get_simd_level();
+    parallel_for(0, count, 1 << 14, [&](int begin, int end) {
+        int done = begin;
+#if defined(M_SIMD_X86)
+        switch (simd_level) {
+            case EAVX2:
+                done = transform_vertices_avx2(matrix, input, output, outcodes, begin, end, width, height);
+                break;
+            case ESSE41:
+                done = transform_vertices_sse41(matrix, input, output, outcodes, begin, end, width, height);
+                break;
+            default:
+                break;
+        }
+#endif
+        transform_vertices_scalar(matrix, input, output, outcodes, done, end, width, height);
+    });
+}
+
+template <typename Mesh>
+void VertexShader::cull(const Mesh &mesh, const std::vector<float3> &face_normals, const float3 &camera,
+                        const std::vector<uint8_t> &outcodes, std::vector<int3> &accepted, std::vector<int> &clipped) {
+    int face_count  = mesh.get_face_count();
+    int chunk_count = std::max(std::min(4 * get_thread_count(), face_count / (1 << 14)), 1);
+    int chunk_size  = (face_count + chunk_count - 1) / chunk_count;
+
+    // Faces with every vertex past one side of the screen or behind the near plane are rejected, and so are back faces
+    // if there are face normals. The rest are accepted as they are, unless they cross the near plane or leave the guard
+    // band.
+    bool cull_back_faces = !face_normals.empty();
+    auto classify        = [&](int i, const int3 &face) {
+        uint8_t a = outcodes[face.x];
+        uint8_t b = outcodes[face.y];
+        uint8_t c = outcodes[face.z];
+        if ((a & b & c & (OutsideScreen | OutsideNear)) != 0) {
+            return 0;
+        }
+        if (cull_back_faces && face_normals[i].dot(float3(mesh.get_position(face.x)) - camera) > 0.0f) {
+            return 0;
         }
-        return false; // Inside screen
+        return ((a | b | c) & (OutsideNear | OutsideGuardBand)) == 0 ? 1 : 2;
     };
-    model->faces.erase(std::remove_if(model->faces.begin(), model->faces.end(), is_outside_screen),
-    model->faces.end());
+
+    // Count the accepted faces of every chunk, then each chunk writes its faces after those of the previous chunks
+    std::vector<int> offsets(chunk_count + 1, 0);
+    std::vector<std::vector<int>> chunk_clipped(chunk_count);
+    parallel_for(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+        for (int chunk = chunk_begin; chunk < chunk_end; chunk++) {
+            int end = std::min((chunk + 1) * chunk_size, face_count);
+            for (int i = chunk * chunk_size; i < end; i++) {
+                int kind = classify(i, mesh.get_face(i));
+                offsets[chunk + 1] += kind == 1;
+                if (kind == 2) {
+                    chunk_clipped[chunk].emplace_back(i);
+                }
+            }
+        }
+    });
+    clipped.clear();
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+        offsets[chunk + 1] += offsets[chunk];
+        clipped.insert(clipped.end(), chunk_clipped[chunk].begin(), chunk_clipped[chunk].end());
+    }
+
+    accepted.resize(offsets[chunk_count]);
+    parallel_for(0, chunk_count, 1, [&](int chunk_begin, int chunk_end) {
+        for (int chunk = chunk_begin; chunk < chunk_end; chunk++) {
+            int end     = std::min((chunk + 1) * chunk_size, face_count);
+            int3 *write = accepted.data() + offsets[chunk];
+            for (int i = chunk * chunk_size; i < end; i++) {
+                int3 face = mesh.get_face(i);
+                if (classify(i, face) == 1) {
+                    *write++ = face;
+                }
+            }
+        }
+    });
+}
+
+template <typename Mesh>
+void VertexShader::clip(const matrix4 &matrix, const Mesh &mesh, const int3 &face, const std::vector<uint8_t> &outcodes,
+                        Model &output) const {
+    bool has_normals = output.has_normals();
+    ClipVertex polygons[2][8];
+    for (int i = 0; i < 3; i++) {
+        polygons[0][i] = { matrix * mesh.get_position(face[i]), has_normals ? output.get_normal(face[i]) : float3(),
+                           face[i] };
+    }
+
+    // A point is inside a plane where their dot product is not negative. The near plane keeps w positive for the
+    // divide, the guard band planes keep the positions in range of the rasterizer.
+    auto width             = static_cast<float>(m_width);
+    auto height            = static_cast<float>(m_height);
+    const float4 planes[5] = { float4(0.0f, 0.0f, 1.0f, 0.0f), float4(1.0f, 0.0f, 0.0f, GuardBand),
+                               float4(-1.0f, 0.0f, 0.0f, width + GuardBand), float4(0.0f, 1.0f, 0.0f, GuardBand),
+                               float4(0.0f, -1.0f, 0.0f, height + GuardBand) };
+    uint8_t outcode        = outcodes[face.x] | outcodes[face.y] | outcodes[face.z];
+    int first_plane        = outcode & OutsideNear ? 0 : 1;
+    int last_plane         = outcode & OutsideGuardBand ? 5 : 1;
+
+    // Sutherland-Hodgman, every plane adds at most one vertex
+    int count   = 3;
+    int current = 0;
+    for (int plane = first_plane; plane < last_plane && count >= 3; plane++) {
+        const float4 &p         = planes[plane];
+        const ClipVertex *input = polygons[current];
+        ClipVertex *result      = polygons[1 - current];
+        int result_count        = 0;
+        for (int i = 0; i < count; i++) {
+            const ClipVertex &a = input[i];
+            const ClipVertex &b = input[(i + 1) % count];
+            float distance_a    = p.x * a.position.x + p.y * a.position.y + p.z * a.position.z + p.w * a.position.w;
+            float distance_b    = p.x * b.position.x + p.y * b.position.y + p.z * b.position.z + p.w * b.position.w;
+            if (distance_a >= 0.0f) {
+                result[result_count++] = a;
+            }
+            if ((distance_a >= 0.0f) != (distance_b >= 0.0f)) {
+                float t                = distance_a / (distance_a - distance_b);
+                result[result_count++] = { a.position + (b.position - a.position) * t,
+                                           a.normal + (b.normal - a.normal) * t, -1 };
+            }
+        }
+        count   = result_count;
+        current = 1 - current;
+    }
+    if (count < 3) {
+        return;
+    }
+
+    // New vertices go after the transformed ones and the polygon becomes a fan
+    int indices[8];
+    for (int i = 0; i < count; i++) {
+        ClipVertex &vertex = polygons[current][i];
+        if (vertex.index < 0) {
+            vertex.index = static_cast<int>(output.vertices.size());
+            output.vertices.emplace_back(vertex.position / vertex.position.w);
+            if (has_normals) {
+                output.normals.emplace_back(vertex.normal.normalize());
+            }
+        }
+        indices[i] = vertex.index;
+    }
+    for (int i = 1; i + 1 < count; i++) {
+        output.faces.emplace_back(indices[0], indices[i], indices[i + 1]);
+    }
 }
 
 matrix4 VertexShader::get_transform_matrix() const { return m_transform_matrix; }
+
+float VertexShader::get_pixels_per_unit(const BoundingBox &bbox) const {
+    float3 center  = bbox.get_center();
+    float radius   = ((bbox.m_max_p - bbox.m_min_p) * 0.5f).magnitude();
+    float distance = (m_view_matrix * float4(center.x, center.y, center.z, 1.0f)).z - radius;
+    if (distance <= 0.0f) {
+        return static_cast<float>(M_MAX_FLOAT);
+    }
+
+    // A unit segment facing the camera at that distance
+    matrix4 projection = m_screen_matrix * m_perspective_matrix;
+    float4 p0          = projection * float4(0.0f, 0.0f, distance, 1.0f);
+    float4 p1          = projection * float4(0.0f, 1.0f, distance, 1.0f);
+    return std::abs(p1.y / p1.w - p0.y / p0.w);
+}
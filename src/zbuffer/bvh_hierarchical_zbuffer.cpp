@@ -1,177 +1,105 @@
+#include <core/rasterizer.h>
 #include <zbuffer/bvh_hierarchical_zbuffer.h>
 
-BVHHierarchicalZBuffer::BVHHierarchicalZBuffer(int width, int height) : ZBuffer(width, height) {
-    m_z_buffer.resize(width * height);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int index         = get_index(y, x);
-            m_z_buffer[index] = std::make_shared<QuadTree>(int2(x, y), int2(x, y), static_cast<float>(M_MAX_FLOAT));
-        }
-    }
-    m_z_pyramid = build_pyramid(int2(0, 0), int2(m_width - 1, m_height - 1));
-    m_accel     = std::make_shared<BVHAccel>();
+BVHHierarchicalZBuffer::BVHHierarchicalZBuffer(int width, int height, BVHBuildMethod build_method)
+    : ZBuffer(width, height), m_z_pyramid(width, height) {
+    m_accel = std::make_shared<BVHAccel>();
+    m_accel->set_build_method(build_method);
 }
 
-std::shared_ptr<QuadTree> BVHHierarchicalZBuffer::build_pyramid(int2 min, int2 max) {
-    if (min.x == max.x && min.y == max.y) {
-        return m_z_buffer[get_index(min.y, min.x)];
-    }
+BVHHierarchicalZBuffer::~BVHHierarchicalZBuffer() = default;
 
-    auto node = std::make_shared<QuadTree>(min, max, static_cast<float>(M_MAX_FLOAT));
-
-    int middle_x = (min.x + max.x) / 2;
-    int middle_y = (min.y + max.y) / 2;
-    auto child   = build_pyramid(int2(min.x, min.y), int2(middle_x, middle_y));
-    node->m_children.emplace_back(child);
-    child->m_parent = node;
-    if (middle_x + 1 <= max.x) {
-        child = build_pyramid(int2(middle_x + 1, min.y), int2(max.x, middle_y));
-        node->m_children.emplace_back(child);
-        child->m_parent = node;
-    }
-    if (middle_y + 1 <= max.y) {
-        child = build_pyramid(int2(min.x, middle_y + 1), int2(middle_x, max.y));
-        node->m_children.emplace_back(child);
-        child->m_parent = node;
-    }
-    if (middle_x + 1 <= max.x && middle_y + 1 <= max.y) {
-        child = build_pyramid(int2(middle_x + 1, middle_y + 1), int2(max.x, max.y));
-        node->m_children.emplace_back(child);
-        child->m_parent = node;
-    }
-    return node;
-}
+void BVHHierarchicalZBuffer::reset() { m_z_pyramid.clear(static_cast<float>(M_MAX_FLOAT)); }
 
-BVHHierarchicalZBuffer::~BVHHierarchicalZBuffer() = default;
+const BVHStats &BVHHierarchicalZBuffer::get_bvh_stats() const { return m_accel->get_stats(); }
 
 void BVHHierarchicalZBuffer::apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) {
     m_accel->set_model(model);
     m_accel->construct();
-    pyramid_test(m_accel->root, m_z_pyramid, model, gbuffer);
+    pyramid_test(model, gbuffer);
+
+    // Pixels outside the rectangle of the model kept their depth
+    const float *depth = m_z_pyramid.data(0);
+    int min_x, max_x, min_y, max_y;
+    get_screen_rect(*model, m_width, m_height, min_x, max_x, min_y, max_y);
+    for (int y = min_y; y <= max_y && !model->faces.empty(); y++) {
+        int row = y * m_width;
+        std::copy(depth + row + min_x, depth + row + max_x + 1, gbuffer->m_depth_buffer.begin() + row + min_x);
+    }
+    resolve(model, gbuffer);
 }
 
-void BVHHierarchicalZBuffer::pyramid_test(const std::shared_ptr<BVHNode> &bvh_node,
-                                          const std::shared_ptr<QuadTree> &zbuffer_node,
-                                          const std::shared_ptr<Model> &model,
+void BVHHierarchicalZBuffer::pyramid_test(const std::shared_ptr<Model> &model,
                                           const std::shared_ptr<GBuffer> &gbuffer) {
-    // Not a node, return
-    if (!bvh_node || !zbuffer_node) {
+    const std::vector<LinearBVHNode> &nodes = m_accel->get_nodes();
+    const std::vector<int> &primitives      = m_accel->get_primitives();
+    if (nodes.empty()) {
         return;
     }
 
-    float3 bvh_min = bvh_node->bounding_box.m_min_p;
-    float3 bvh_max = bvh_node->bounding_box.m_max_p;
-
-    // BVH is not in the bounding box or bvh near is greater than current zbuffer, return
-    if (bvh_max.x < static_cast<float>(zbuffer_node->m_min.x) ||
-        bvh_min.x > static_cast<float>(zbuffer_node->m_max.x + 1) ||
-        bvh_max.y < static_cast<float>(zbuffer_node->m_min.y) ||
-        bvh_min.y > static_cast<float>(zbuffer_node->m_max.y + 1) || bvh_min.z > zbuffer_node->m_value) {
-        return;
-    }
-
-    bool recursive_test = false;
-    int idx             = 0;
-    for (idx = 0; idx < zbuffer_node->m_children.size(); idx++) {
-        if (bvh_min.x >= static_cast<float>(zbuffer_node->m_children[idx]->m_min.x) &&
-            bvh_min.y >= static_cast<float>(zbuffer_node->m_children[idx]->m_min.y) &&
-            bvh_max.x <= static_cast<float>(zbuffer_node->m_children[idx]->m_max.x + 1) &&
-            bvh_max.y <= static_cast<float>(zbuffer_node->m_children[idx]->m_max.y + 1)) {
-            recursive_test = true;
-            break;
-        }
-    }
-    if (recursive_test) { // BVH is in current zbuffer
-        pyramid_test(bvh_node, zbuffer_node->m_children[idx], model, gbuffer);
-    } else { // BVH is not in current zbuffer, split bvh or start node testing
-        if (bvh_min.x <= static_cast<float>(zbuffer_node->m_min.x) &&
-            bvh_min.y <= static_cast<float>(zbuffer_node->m_min.y) &&
-            bvh_max.x >= static_cast<float>(zbuffer_node->m_max.x + 1) &&
-            bvh_max.y >= static_cast<float>(zbuffer_node->m_max.y + 1)) {
-            update_z(zbuffer_node, bvh_max.z);
+    // Nodes are tested when popped, so the far child sees everything the near child drew
+    m_node_stack.clear();
+    m_node_stack.emplace_back(0);
+    while (!m_node_stack.empty()) {
+        int node_index = m_node_stack.back();
+        m_node_stack.pop_back();
+        const LinearBVHNode &bvh_node = nodes[node_index];
+
+        // BVH is outside the screen or its near z is behind the pyramid, skip
+        const float3 &bvh_min = bvh_node.min_p;
+        const float3 &bvh_max = bvh_node.max_p;
+        int min_x             = std::max(static_cast<int>(std::floor(bvh_min.x)), 0);
+        int max_x             = std::min(static_cast<int>(std::ceil(bvh_max.x)), m_width - 1);
+        int min_y             = std::max(static_cast<int>(std::floor(bvh_min.y)), 0);
+        int max_y             = std::min(static_cast<int>(std::ceil(bvh_max.y)), m_height - 1);
+        if (min_x > max_x || min_y > max_y || bvh_min.z > m_z_pyramid.max_depth(min_x, max_x, min_y, max_y)) {
+            continue;
         }
-        if (bvh_node->is_leaf) {
-            leaf_node_test(bvh_node, zbuffer_node, model, gbuffer);
-        } else {
-            pyramid_test(bvh_node->left, zbuffer_node, model, gbuffer);
-            pyramid_test(bvh_node->right, zbuffer_node, model, gbuffer);
+
+        if (bvh_node.is_leaf()) {
+            for (int i = bvh_node.primitive_offset; i < bvh_node.primitive_offset + bvh_node.primitive_count; i++) {
+                triangle_test(primitives[i], model, gbuffer);
+            }
+            continue;
         }
-    }
 
-    // Update current node z value
-    float max_z = -M_MAX_FLOAT;
-    for (const auto &child : zbuffer_node->m_children) {
-        max_z = std::max(max_z, child->m_value);
+        // Screen space z grows away from the camera, push the far child first so the near one is drawn first
+        int near_child = node_index + 1;
+        int far_child  = bvh_node.right_child_offset;
+        if (nodes[far_child].min_p.z < nodes[near_child].min_p.z) {
+            std::swap(near_child, far_child);
+        }
+        m_node_stack.emplace_back(far_child);
+        m_node_stack.emplace_back(near_child);
     }
-    zbuffer_node->m_value = max_z;
 }
 
-void BVHHierarchicalZBuffer::leaf_node_test(const std::shared_ptr<BVHNode> &bvh_node,
-                                            const std::shared_ptr<QuadTree> &zbuffer_node,
-                                            const std::shared_ptr<Model> &model,
-                                            const std::shared_ptr<GBuffer> &gbuffer) {
-    for (int tri_id : bvh_node->primitives) {
-        Fragment fragment(float3(model->vertices[model->faces[tri_id].x]),
-                          float3(model->vertices[model->faces[tri_id].y]),
-                          float3(model->vertices[model->faces[tri_id].z]), tri_id);
-        node_test(fragment, zbuffer_node, model, gbuffer);
-    }
-}
+void BVHHierarchicalZBuffer::triangle_test(int tri_id, const std::shared_ptr<Model> &model,
+                                           const std::shared_ptr<GBuffer> &gbuffer) {
+    const int3 &face = model->faces[tri_id];
+    const float4 &p0 = model->vertices[face.x];
+    const float4 &p1 = model->vertices[face.y];
+    const float4 &p2 = model->vertices[face.z];
 
-float BVHHierarchicalZBuffer::node_test(const Fragment &fragment, const std::shared_ptr<QuadTree> &node,
-                                        const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) {
-    if (static_cast<float>(node->m_max.x + 1) < fragment.min_x || static_cast<float>(node->m_min.x) > fragment.max_x ||
-        static_cast<float>(node->m_max.y + 1) < fragment.min_y || static_cast<float>(node->m_min.y) > fragment.max_y) {
-        return node->m_value;
+    TriangleSetup setup{};
+    if (!setup_triangle(p0, p1, p2, setup)) {
+        return;
     }
 
-    if (node->m_min.x == node->m_max.x && node->m_min.y == node->m_max.y) {
-        auto pixel      = float2(static_cast<float>(node->m_min.x) + 0.5f, static_cast<float>(node->m_min.y) + 0.5f);
-        auto project_p0 = float2(fragment.p0.x, fragment.p0.y);
-        auto project_p1 = float2(fragment.p1.x, fragment.p1.y);
-        auto project_p2 = float2(fragment.p2.x, fragment.p2.y);
-        auto edge1      = project_p0 - project_p1;
-        auto edge2      = project_p1 - project_p2;
-        auto edge3      = project_p2 - project_p0;
-        auto area       = std::abs(edge1.cross(edge2)) / 2.0f;
-        auto gamma      = edge1.cross(pixel - project_p1) / 2.0f;
-        auto alpha      = edge2.cross(pixel - project_p2) / 2.0f;
-        auto beta       = edge3.cross(pixel - project_p0) / 2.0f;
-        if (alpha * beta > 0.0f && alpha * gamma > 0.0f) {
-            alpha     = std::abs(alpha) / area;
-            beta      = std::abs(beta) / area;
-            gamma     = 1 - alpha - beta;
-            int index = get_index(node->m_min.y, node->m_min.x);
-            float z   = alpha * fragment.p0.z + beta * fragment.p1.z + gamma * fragment.p2.z;
-            if (z < m_z_buffer[index]->m_value) {
-                int tri_id                           = fragment.tri_id;
-                m_z_buffer[index]->m_value           = z;
-                gbuffer->m_depth_buffer[index]       = z;
-                gbuffer->m_barycentric_buffer[index] = std::make_pair(alpha, beta);
-                gbuffer->m_normal_buffer[index]      = model->normals[model->faces[tri_id].x] * alpha +
-                                                  model->normals[model->faces[tri_id].y] * beta +
-                                                  model->normals[model->faces[tri_id].z] * gamma;
-                gbuffer->m_triangle_id_buffer[index] = tri_id;
-            }
-            return z;
-        }
-        return node->m_value;
+    int min_x = std::max(setup.min_x, 0);
+    int max_x = std::min(setup.max_x, m_width - 1);
+    int min_y = std::max(setup.min_y, 0);
+    int max_y = std::min(setup.max_y, m_height - 1);
+    if (min_x > max_x || min_y > max_y) {
+        return;
     }
 
-    float max_z = -M_MAX_FLOAT;
-    for (const auto &child : node->m_children) {
-        float temp_z = node_test(fragment, child, model, gbuffer);
-        max_z        = std::max(max_z, temp_z);
+    float min_z = std::min(std::min(p0.z, p1.z), p2.z);
+    if (min_z > m_z_pyramid.max_depth(min_x, max_x, min_y, max_y)) {
+        return;
     }
-    node->m_value = max_z;
-    return node->m_value;
-}
-
-int BVHHierarchicalZBuffer::get_index(int row, int col) const { return row * m_width + col; }
 
-void BVHHierarchicalZBuffer::update_z(const std::shared_ptr<QuadTree> &node, float value) {
-    node->m_value = std::max(node->m_value, value);
-    for (const auto &child : node->m_children) {
-        update_z(child, value);
-    }
+    rasterize_depth(setup, model->first_face_id + tri_id, min_x, max_x, min_y, max_y, m_z_pyramid.data(0),
+                    gbuffer->m_triangle_id_buffer.data(), m_width);
+    m_z_pyramid.update(min_x, max_x, min_y, max_y);
 }
@@ -1,9 +1,22 @@
 #include <algorithm>
+#include <core/parallel.h>
 #include <zbuffer/scanline_zbuffer.h>
 
-ScanlineZBuffer::ScanlineZBuffer(int width, int height) : ZBuffer(width, height) {
-    m_classified_edge_table.resize(height);
-    m_classified_polygon_table.resize(height);
+ScanlineZBuffer::ScanlineZBuffer(int width, int height, int band_count) : ZBuffer(width, height) {
+    if (band_count <= 0) {
+        int thread_count = get_thread_count();
+        band_count       = thread_count > 1 ? 4 * thread_count : 1;
+    }
+    band_count = std::max(std::min(band_count, height), 1);
+
+    m_bands.resize(band_count);
+    m_row_band.resize(height);
+    for (int i = 0; i < band_count; i++) {
+        m_bands[i].min_y = height * i / band_count;
+        m_bands[i].max_y = height * (i + 1) / band_count - 1;
+        m_bands[i].polygon_offset.resize(m_bands[i].max_y - m_bands[i].min_y + 2);
+        std::fill(m_row_band.begin() + m_bands[i].min_y, m_row_band.begin() + m_bands[i].max_y + 1, i);
+    }
 }
 
 ScanlineZBuffer::~ScanlineZBuffer() = default;
@@ -16,226 +29,208 @@ int ScanlineZBuffer::above_scanline_count(float y) const {
 }
 
 void ScanlineZBuffer::apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) {
-    initialize(model);
-    for (int y = m_height - 1; y >= 0; y--) {
-        add_active_table(y);
-        update_depth(y, gbuffer, model);
-        cull_active_table();
-    }
+    bin_in_chunks(static_cast<int>(model->faces.size()), m_bins,
+                  [&](int chunk, int begin, int end) { bin_triangles(chunk, begin, end, model); });
+
+    // Bands write disjoint rows of the gbuffer, so they need no locking
+    parallel_for(0, static_cast<int>(m_bands.size()), 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            ScanlineBand &band = m_bands[i];
+            initialize(i, model);
+            for (int y = band.max_y; y >= band.min_y; y--) {
+                add_active_table(band, y, model);
+                update_depth(band, y, gbuffer);
+                cull_active_table(band);
+            }
+        }
+    });
+    resolve(model, gbuffer);
 }
 
-void ScanlineZBuffer::initialize(const std::shared_ptr<Model> &model) {
-    for (int i = 0; i < model->faces.size(); i++) {
-        bool has_intersection = false;
-        std::vector<std::pair<int, EdgeClassify>> temp_edge_table;
-        float max_y      = -M_MAX_FLOAT;
-        float min_y      = M_MAX_FLOAT;
+void ScanlineZBuffer::bin_triangles(int chunk, int begin, int end, const std::shared_ptr<Model> &model) {
+    auto &bins = m_bins[chunk];
+    bins.resize(m_bands.size());
+    for (auto &bin : bins) {
+        bin.clear();
+    }
+
+    for (int i = begin; i < end; i++) {
         const auto &face = model->faces[i];
+        const float4 &p0 = model->vertices[face.x];
+        const float4 &p1 = model->vertices[face.y];
+        const float4 &p2 = model->vertices[face.z];
+
+        // Triangle which is entirely left or right of the screen
+        if (std::max(std::max(p0.x, p1.x), p2.x) < 0.0f ||
+            std::min(std::min(p0.x, p1.x), p2.x) > static_cast<float>(m_width)) {
+            continue;
+        }
 
-        for (int j = 0; j < 3; j++) {
-            float4 p1 = model->vertices[face[j]];
-            float4 p2 = model->vertices[face[(j + 1) % 3]];
+        int top    = above_scanline_count(std::max(std::max(p0.y, p1.y), p2.y)) - 1;
+        int bottom = above_scanline_count(std::min(std::min(p0.y, p1.y), p2.y));
+        if (top < bottom) { // Triangle which does not intersect the scanline
+            continue;
+        }
+        for (int band = m_row_band[bottom]; band <= m_row_band[top]; band++) {
+            bins[band].emplace_back(i);
+        }
+    }
+}
 
-            if (std::abs(p1.y - p2.y) < M_EPSILON) { // Parallel to the scanline
-                continue;
-            }
+void ScanlineZBuffer::initialize(int band_index, const std::shared_ptr<Model> &model) {
+    ScanlineBand &band = m_bands[band_index];
+    band.polygon_pool.clear();
+    band.edge_pool.clear();
+    band.active_edge_table.clear();
+    std::fill(band.polygon_offset.begin(), band.polygon_offset.end(), 0);
 
-            if (p1.y < p2.y) { // p1 has max y value
-                std::swap(p1, p2);
-            }
+    for (const auto &bins : m_bins) {
+        for (int i : bins[band_index]) {
+            classify_triangle(band, i, model);
+        }
+    }
 
-            max_y = M_MAX(max_y, p1.y);
-            min_y = M_MIN(min_y, p2.y);
+    // Counting sort of the polygons into their first scanline bucket
+    int row_count = band.max_y - band.min_y + 1;
+    for (int y = 0; y < row_count; y++) {
+        band.polygon_offset[y + 1] += band.polygon_offset[y];
+    }
+    band.classified_polygon_table.resize(band.polygon_pool.size());
+    for (const auto &polygon : band.polygon_pool) {
+        band.classified_polygon_table[band.polygon_offset[polygon.y - band.min_y]++] = polygon;
+    }
+    // Scattering moved every offset to the end of its bucket, shift them back
+    for (int y = row_count; y > 0; y--) {
+        band.polygon_offset[y] = band.polygon_offset[y - 1];
+    }
+    band.polygon_offset[0] = 0;
+}
 
-            EdgeClassify edge_classify;
-            edge_classify.y  = p1.y;
-            edge_classify.x  = p1.x;
-            edge_classify.id = i;
-            edge_classify.dy = above_scanline_count(p1.y) - above_scanline_count(p2.y);
-            edge_classify.dx = (p2.x - p1.x) / (p1.y - p2.y);
+void ScanlineZBuffer::classify_triangle(ScanlineBand &band, int tri_id, const std::shared_ptr<Model> &model) const {
+    const auto &face   = model->faces[tri_id];
+    const float4 *p[3] = { &model->vertices[face.x], &model->vertices[face.y], &model->vertices[face.z] };
 
-            if (edge_classify.dy > 0) {
-                // Edge which does not intersect the scanline will not be added
-                temp_edge_table.emplace_back(above_scanline_count(p1.y) - 1, edge_classify);
-                has_intersection = true;
-            }
-        }
+    // Order vertices from top to bottom, edges are then top-middle, middle-bottom and top-bottom
+    if (p[0]->y < p[1]->y) {
+        std::swap(p[0], p[1]);
+    }
+    if (p[1]->y < p[2]->y) {
+        std::swap(p[1], p[2]);
+    }
+    if (p[0]->y < p[1]->y) {
+        std::swap(p[0], p[1]);
+    }
+    // Scanlines [row[2], row[0] - 1] intersect the triangle
+    int row[3] = { above_scanline_count(p[0]->y), above_scanline_count(p[1]->y), above_scanline_count(p[2]->y) };
+    if (row[0] == row[2] || row[0] - 1 < band.min_y || row[2] > band.max_y) { // Not in the band
+        return;
+    }
 
-        if (has_intersection) { // Add triangle which intersects the scanline
-            PolygonClassify polygon_classify;
-            polygon_classify.id = i;
-            polygon_classify.dy = above_scanline_count(max_y) - above_scanline_count(min_y);
-            float3 p0(model->vertices[face.x]);
-            float3 p1(model->vertices[face.y]);
-            float3 p2(model->vertices[face.z]);
-            // Cull face which are not in the frustum manually
-            // if ((max_y <= 0 && max_y >= static_cast<float>(m_height)) ||
-            //     (p0.x <= 0 || p0.x >= static_cast<float>(m_width)) ||
-            //     (p1.x <= 0 || p1.x >= static_cast<float>(m_width)) ||
-            //     (p2.x <= 0 || p2.x >= static_cast<float>(m_width))) {
-            //     continue;
-            // }
-            // Calculate face normals in screen space instead of world space
-            float3 face_normal = (p2 - p0).cross(p1 - p0).normalize();
-            polygon_classify.a = face_normal.x;
-            polygon_classify.b = face_normal.y;
-            polygon_classify.c = face_normal.z;
-            polygon_classify.d = -(face_normal.x * p0.x + face_normal.y * p0.y + face_normal.z * p0.z);
-            // Ignore those which are perpendicular to xoy plane
-            if (std::abs(polygon_classify.c) > M_EPSILON) {
-                for (auto &[index, edge_classify] : temp_edge_table) {
-                    m_classified_edge_table[index].push_back(edge_classify);
-                }
-                m_classified_polygon_table[above_scanline_count(max_y) - 1].emplace_back(polygon_classify);
-            }
+    int first_edge = static_cast<int>(band.edge_pool.size());
+    auto add_edge  = [&](int top, int bottom) {
+        EdgeClassify edge_classify;
+        edge_classify.y  = row[top] - 1;
+        edge_classify.dy = row[top] - row[bottom];
+        // Edges starting above the band start on its first scanline instead
+        int skip = std::max(edge_classify.y - band.max_y, 0);
+        if (edge_classify.dy - skip <= 0 || edge_classify.y - skip < band.min_y) {
+            return; // Edge which does not intersect the scanlines of the band will not be added
         }
+        float distance   = p[top]->y - static_cast<float>(row[top]) + 0.5f + static_cast<float>(skip);
+        edge_classify.dx = (p[bottom]->x - p[top]->x) / (p[top]->y - p[bottom]->y);
+        edge_classify.x  = p[top]->x + distance * edge_classify.dx;
+        edge_classify.y -= skip;
+        edge_classify.dy -= skip;
+        band.edge_pool.emplace_back(edge_classify);
+    };
+    add_edge(0, 2);
+    add_edge(0, 1);
+    add_edge(1, 2);
+
+    // The two edges starting on the first scanline come first, from left to right
+    EdgeClassify &a = band.edge_pool[first_edge];
+    EdgeClassify &b = band.edge_pool[first_edge + 1];
+    if (b.x < a.x || (b.x == a.x && b.dx < a.dx)) {
+        std::swap(a, b);
     }
-}
 
-void ScanlineZBuffer::add_active_table(int y) {
-    m_active_polygon_table.insert(m_active_polygon_table.end(), m_classified_polygon_table[y].begin(),
-                                  m_classified_polygon_table[y].end());
+    PolygonClassify polygon_classify;
+    polygon_classify.id         = tri_id;
+    polygon_classify.y          = a.y;
+    polygon_classify.first_edge = first_edge;
+    polygon_classify.edge_count = static_cast<int>(band.edge_pool.size()) - first_edge;
+    band.polygon_pool.emplace_back(polygon_classify);
+    band.polygon_offset[polygon_classify.y - band.min_y + 1]++;
+}
 
-    for (const auto &polygon : m_classified_polygon_table[y]) { // Add a polygon to the active polygon table
-        // Find related edge of the current polygon
-        std::vector<EdgeClassify> related_edge;
-        for (const auto &edge : m_classified_edge_table[y]) {
-            if (edge.id == polygon.id) {
-                related_edge.emplace_back(edge);
-            }
+void ScanlineZBuffer::add_active_table(ScanlineBand &band, int y, const std::shared_ptr<Model> &model) const {
+    int bucket = y - band.min_y;
+    for (int p = band.polygon_offset[bucket]; p < band.polygon_offset[bucket + 1]; p++) {
+        const PolygonClassify &polygon = band.classified_polygon_table[p];
+
+        // Add active edge pair, the setup is written in place
+        ActiveEdge &active_edge = band.active_edge_table.emplace_back();
+        const int3 &face        = model->faces[polygon.id];
+        if (!setup_triangle(model->vertices[face.x], model->vertices[face.y], model->vertices[face.z],
+                            active_edge.setup)) {
+            band.active_edge_table.pop_back();
+            continue;
         }
-
-        // Sort edge from left to right
-        std::sort(related_edge.begin(), related_edge.end(), [](const EdgeClassify &a, const EdgeClassify &b) {
-            if (a.x < b.x) {
-                return true;
-            }
-            if (a.x == b.x) {
-                return a.dx < b.dx;
-            }
-            return false;
-        });
-
-        // Add active edge pair
-        ActiveEdge active_edge;
-        active_edge.id  = polygon.id;
-        active_edge.dzx = -(polygon.a / polygon.c);
-        active_edge.dzy = polygon.b / polygon.c;
-        active_edge.xl  = related_edge[0].x +
-                         (related_edge[0].y - static_cast<float>(above_scanline_count(related_edge[0].y)) + 0.5f) *
-                             related_edge[0].dx;
-        active_edge.dxl = related_edge[0].dx;
-        active_edge.dyl = related_edge[0].dy;
-        active_edge.zl  = -(polygon.d + polygon.a * active_edge.xl +
-                           polygon.b * (static_cast<float>(above_scanline_count(related_edge[0].y)) - 0.5f)) /
-                         polygon.c;
-        active_edge.xr =
-            related_edge[1].x + (related_edge[1].y - std::round(related_edge[1].y) + 0.5f) * related_edge[1].dx;
-        active_edge.dxr = related_edge[1].dx;
-        active_edge.dyr = related_edge[1].dy;
-        m_active_edge_table.emplace_back(active_edge);
+        const EdgeClassify &left  = band.edge_pool[polygon.first_edge];
+        const EdgeClassify &right = band.edge_pool[polygon.first_edge + 1];
+        active_edge.id            = model->first_face_id + polygon.id;
+        active_edge.xl            = left.x;
+        active_edge.dxl           = left.dx;
+        active_edge.dyl           = left.dy;
+        active_edge.xr            = right.x;
+        active_edge.dxr           = right.dx;
+        active_edge.dyr           = right.dy;
+        active_edge.next_edge     = polygon.edge_count > 2 ? polygon.first_edge + 2 : -1;
     }
 }
 
-void ScanlineZBuffer::update_depth(int y, const std::shared_ptr<GBuffer> &gbuffer,
-                                   const std::shared_ptr<Model> &model) {
-    for (auto &active_edge : m_active_edge_table) {
-        float zx = active_edge.zl + active_edge.dzx * (std::round(active_edge.xl) + 0.5f - active_edge.xl);
-        for (int x = static_cast<int>(std::round(active_edge.xl)); x < static_cast<int>(std::round(active_edge.xr));
-             x++) {
-
-            // int idx = gbuffer->index(y, x);
-            // if (zx < gbuffer->m_depth_buffer[idx]) {
-            //     int tri_id                         = active_edge.id;
-            //     gbuffer->m_depth_buffer[idx]       = zx;
-            //     gbuffer->m_triangle_id_buffer[idx] = tri_id;
-            //     gbuffer->m_normal_buffer[idx]      = model->face_normals[tri_id];
-            //     gbuffer->m_barycentric_buffer[idx] = std::make_pair(1.0f / 3.0f, 1.0f / 3.0f);
-            // }
-
-            auto pixel      = float2(static_cast<float>(x) + 0.5f, static_cast<float>(y) + 0.5f);
-            auto p0         = model->vertices[model->faces[active_edge.id].x];
-            auto p1         = model->vertices[model->faces[active_edge.id].y];
-            auto p2         = model->vertices[model->faces[active_edge.id].z];
-            auto project_p0 = float2(p0.x, p0.y);
-            auto project_p1 = float2(p1.x, p1.y);
-            auto project_p2 = float2(p2.x, p2.y);
-            auto edge1      = project_p0 - project_p1;
-            auto edge2      = project_p1 - project_p2;
-            auto edge3      = project_p2 - project_p0;
-
-            auto area  = std::abs(edge1.cross(edge2)) / 2.0f;
-            auto gamma = edge1.cross(pixel - project_p1) / 2.0f;
-            auto alpha = edge2.cross(pixel - project_p2) / 2.0f;
-            auto beta  = edge3.cross(pixel - project_p0) / 2.0f;
-
-            if (alpha * beta > 0.0f && alpha * gamma > 0.0f) {
-                alpha       = std::abs(alpha) / area;
-                beta        = std::abs(beta) / area;
-                gamma       = 1 - alpha - beta;
-                float depth = alpha * p0.z + beta * p1.z + gamma * p2.z;
-                int idx     = gbuffer->index(y, x);
-
-                if (depth < gbuffer->m_depth_buffer[idx]) {
-                    gbuffer->m_depth_buffer[idx]       = depth;
-                    gbuffer->m_triangle_id_buffer[idx] = active_edge.id;
-                    gbuffer->m_normal_buffer[idx]      = model->normals[model->faces[active_edge.id].x] * alpha +
-                                                    model->normals[model->faces[active_edge.id].y] * beta +
-                                                    model->normals[model->faces[active_edge.id].z] * gamma;
-                }
-            }
-
-            zx += active_edge.dzx;
-        }
+void ScanlineZBuffer::update_depth(ScanlineBand &band, int y, const std::shared_ptr<GBuffer> &gbuffer) const {
+    for (auto &active_edge : band.active_edge_table) {
+        // The span starts a pixel left of the rounded xl and ends at the rounded xr, the edge functions decide coverage
+        const TriangleSetup &setup = active_edge.setup;
+        int min_x = std::max(std::max(static_cast<int>(std::round(active_edge.xl)) - 1, setup.min_x), 0);
+        int max_x = std::min(std::min(static_cast<int>(std::round(active_edge.xr)), setup.max_x), m_width - 1);
+        rasterize_depth(setup, active_edge.id, min_x, max_x, y, y, gbuffer->m_depth_buffer.data(),
+                        gbuffer->m_triangle_id_buffer.data(), gbuffer->m_width);
 
         active_edge.dyl--;
         active_edge.dyr--;
         active_edge.xl += active_edge.dxl;
         active_edge.xr += active_edge.dxr;
-        active_edge.zl += active_edge.dzx * active_edge.dxl + active_edge.dzy;
 
         if (active_edge.dyl <= 0 || active_edge.dyr <= 0) {
-            find_replace_edge(y - 1, active_edge); // Find edge of the next line, instead of current line
+            replace_edge(band, active_edge); // Edge of the next line, instead of current line
         }
     }
 }
 
-void ScanlineZBuffer::find_replace_edge(int y, ActiveEdge &active_edge) const {
-    std::vector<EdgeClassify> related_edge;
-
-    for (const auto &edge : m_classified_edge_table[y]) {
-        if (edge.id == active_edge.id) {
-            related_edge.emplace_back(edge);
-        }
-    }
-
-    if (related_edge.empty()) {
+void ScanlineZBuffer::replace_edge(const ScanlineBand &band, ActiveEdge &active_edge) {
+    if (active_edge.next_edge < 0) {
         return;
     }
 
+    const EdgeClassify &edge = band.edge_pool[active_edge.next_edge];
     if (active_edge.dyl <= 0) {
-        active_edge.xl =
-            related_edge[0].x + (related_edge[0].y - std::round(related_edge[0].y) + 0.5f) * related_edge[0].dx;
-        active_edge.dxl = related_edge[0].dx;
-        active_edge.dyl = related_edge[0].dy;
+        active_edge.xl  = edge.x;
+        active_edge.dxl = edge.dx;
+        active_edge.dyl = edge.dy;
     } else if (active_edge.dyr <= 0) {
-        active_edge.xr =
-            related_edge[0].x + (related_edge[0].y - std::round(related_edge[0].y) + 0.5f) * related_edge[0].dx;
-        active_edge.dxr = related_edge[0].dx;
-        active_edge.dyr = related_edge[0].dy;
+        active_edge.xr  = edge.x;
+        active_edge.dxr = edge.dx;
+        active_edge.dyr = edge.dy;
     }
+    active_edge.next_edge = -1;
 }
 
-void ScanlineZBuffer::cull_active_table() {
-    for (auto &active_polygon : m_active_polygon_table) {
-        active_polygon.dy--;
-    }
-    m_active_polygon_table.erase(std::remove_if(m_active_polygon_table.begin(), m_active_polygon_table.end(),
-                                                [](const auto &active_polygon) { return active_polygon.dy <= 0; }),
-                                 m_active_polygon_table.end());
-
-    m_active_edge_table.erase(
-        std::remove_if(m_active_edge_table.begin(), m_active_edge_table.end(),
-                       [](const auto &active_edge) { return active_edge.dyl <= 0 && active_edge.dyr <= 0; }),
-        m_active_edge_table.end());
+void ScanlineZBuffer::cull_active_table(ScanlineBand &band) {
+    // A polygon is done once one side runs out of edges
+    band.active_edge_table.erase(
+        std::remove_if(band.active_edge_table.begin(), band.active_edge_table.end(),
+                       [](const auto &active_edge) { return active_edge.dyl <= 0 || active_edge.dyr <= 0; }),
+        band.active_edge_table.end());
 }
@@ -0,0 +1,78 @@
+#include <core/parallel.h>
+#include <core/rasterizer.h>
+#include <zbuffer/tiled_zbuffer.h>
+
+TiledZBuffer::TiledZBuffer(int width, int height, int tile_size) : ZBuffer(width, height), m_tile_size(tile_size) {
+    m_tile_count_x = (width + tile_size - 1) / tile_size;
+    m_tile_count_y = (height + tile_size - 1) / tile_size;
+}
+
+TiledZBuffer::~TiledZBuffer() = default;
+
+void TiledZBuffer::apply(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) {
+    bin_in_chunks(static_cast<int>(model->faces.size()), m_bins,
+                  [&](int chunk, int begin, int end) { bin_triangles(chunk, begin, end, model); });
+
+    // Rasterize tiles, every tile writes only its own pixels so no locking is needed
+    parallel_for(0, m_tile_count_x * m_tile_count_y, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; tile++) {
+            rasterize_tile(tile, model, gbuffer);
+        }
+    });
+
+    resolve(model, gbuffer);
+}
+
+void TiledZBuffer::bin_triangles(int chunk, int begin, int end, const std::shared_ptr<Model> &model) {
+    auto &bins = m_bins[chunk];
+    bins.resize(m_tile_count_x * m_tile_count_y);
+    for (auto &bin : bins) {
+        bin.clear();
+    }
+
+    for (int tri_id = begin; tri_id < end; tri_id++) {
+        float4 p0 = model->vertices[model->faces[tri_id].x];
+        float4 p1 = model->vertices[model->faces[tri_id].y];
+        float4 p2 = model->vertices[model->faces[tri_id].z];
+
+        int min_x = std::max(static_cast<int>(std::floor(std::min(std::min(p0.x, p1.x), p2.x))), 0);
+        int max_x = std::min(static_cast<int>(std::ceil(std::max(std::max(p0.x, p1.x), p2.x))), m_width - 1);
+        int min_y = std::max(static_cast<int>(std::floor(std::min(std::min(p0.y, p1.y), p2.y))), 0);
+        int max_y = std::min(static_cast<int>(std::ceil(std::max(std::max(p0.y, p1.y), p2.y))), m_height - 1);
+        if (min_x > max_x || min_y > max_y) {
+            continue;
+        }
+
+        for (int tile_y = min_y / m_tile_size; tile_y <= max_y / m_tile_size; tile_y++) {
+            for (int tile_x = min_x / m_tile_size; tile_x <= max_x / m_tile_size; tile_x++) {
+                bins[tile_y * m_tile_count_x + tile_x].emplace_back(tri_id);
+            }
+        }
+    }
+}
+
+void TiledZBuffer::rasterize_tile(int tile, const std::shared_ptr<Model> &model,
+                                  const std::shared_ptr<GBuffer> &gbuffer) const {
+    int tile_min_x = (tile % m_tile_count_x) * m_tile_size;
+    int tile_min_y = (tile / m_tile_count_x) * m_tile_size;
+    int tile_max_x = std::min(tile_min_x + m_tile_size, m_width) - 1;
+    int tile_max_y = std::min(tile_min_y + m_tile_size, m_height) - 1;
+
+    TriangleSetup setup{};
+    for (const auto &bins : m_bins) {
+        for (int tri_id : bins[tile]) {
+            const int3 &face = model->faces[tri_id];
+            if (!setup_triangle(model->vertices[face.x], model->vertices[face.y], model->vertices[face.z], setup)) {
+                continue;
+            }
+
+            int min_x = std::max(setup.min_x, tile_min_x);
+            int max_x = std::min(setup.max_x, tile_max_x);
+            int min_y = std::max(setup.min_y, tile_min_y);
+            int max_y = std::min(setup.max_y, tile_max_y);
+
+            rasterize_depth(setup, model->first_face_id + tri_id, min_x, max_x, min_y, max_y,
+                            gbuffer->m_depth_buffer.data(), gbuffer->m_triangle_id_buffer.data(), gbuffer->m_width);
+        }
+    }
+}
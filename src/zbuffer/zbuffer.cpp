@@ -1,6 +1,80 @@
+#include <algorithm>
+#include <core/parallel.h>
+#include <core/rasterizer.h>
 #include <zbuffer/zbuffer.h>
 
 ZBuffer::ZBuffer(int width, int height) {
     m_width   = width;
     m_height  = height;
 }
+
+void ZBuffer::reset() {}
+
+void ZBuffer::get_screen_rect(const Model &model, int width, int height, int &min_x, int &max_x, int &min_y,
+                              int &max_y) {
+    float3 min_p(M_MAX_FLOAT, M_MAX_FLOAT, 0);
+    float3 max_p(-M_MAX_FLOAT, -M_MAX_FLOAT, 0);
+    for (const float4 &vertex : model.vertices) {
+        min_p.x = std::min(min_p.x, vertex.x);
+        min_p.y = std::min(min_p.y, vertex.y);
+        max_p.x = std::max(max_p.x, vertex.x);
+        max_p.y = std::max(max_p.y, vertex.y);
+    }
+    min_x = static_cast<int>(std::floor(std::clamp(min_p.x, 0.0f, static_cast<float>(width - 1))));
+    max_x = static_cast<int>(std::ceil(std::clamp(max_p.x, 0.0f, static_cast<float>(width - 1))));
+    min_y = static_cast<int>(std::floor(std::clamp(min_p.y, 0.0f, static_cast<float>(height - 1))));
+    max_y = static_cast<int>(std::ceil(std::clamp(max_p.y, 0.0f, static_cast<float>(height - 1))));
+}
+
+void ZBuffer::bin_in_chunks(int face_count, std::vector<std::vector<std::vector<int>>> &bins,
+                            const std::function<void(int, int, int)> &bin) {
+    int chunk_count = get_thread_count();
+    bins.resize(chunk_count);
+    parallel_for(0, chunk_count, 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk++) {
+            int face_begin = static_cast<int>(static_cast<int64_t>(face_count) * chunk / chunk_count);
+            int face_end   = static_cast<int>(static_cast<int64_t>(face_count) * (chunk + 1) / chunk_count);
+            bin(chunk, face_begin, face_end);
+        }
+    });
+}
+
+void ZBuffer::resolve(const std::shared_ptr<Model> &model, const std::shared_ptr<GBuffer> &gbuffer) {
+    int face_count = static_cast<int>(model->faces.size());
+    if (face_count == 0) {
+        return;
+    }
+
+    // Faces of the model can only show inside the rectangle around its vertices, which matters when many small models
+    // or batches are drawn into one frame
+    int min_x, max_x, min_y, max_y;
+    get_screen_rect(*model, gbuffer->m_width, gbuffer->m_height, min_x, max_x, min_y, max_y);
+    bool has_normals = model->has_normals();
+    parallel_for(min_y, max_y + 1, 16, [&](int begin, int end) {
+        // Neighbouring pixels mostly share a triangle, keep its setup around
+        TriangleSetup setup{};
+        int setup_id = -1;
+        for (int y = begin; y < end; y++) {
+            for (int x = min_x; x <= max_x; x++) {
+                int idx    = gbuffer->index(y, x);
+                int tri_id = gbuffer->m_triangle_id_buffer[idx] - model->first_face_id;
+                if (tri_id < 0 || tri_id >= face_count) {
+                    continue;
+                }
+                const int3 &face = model->faces[tri_id];
+                if (tri_id != setup_id) {
+                    setup_triangle(model->vertices[face.x], model->vertices[face.y], model->vertices[face.z], setup);
+                    setup_id = tri_id;
+                }
+                auto [alpha, beta]                 = setup.barycentric(x, y);
+                float gamma                        = 1 - alpha - beta;
+                gbuffer->m_barycentric_buffer[idx] = std::make_pair(alpha, beta);
+                // Models without vertex normals leave the normal buffer as reset
+                if (has_normals) {
+                    gbuffer->m_normal_buffer[idx] = model->get_normal(face.x) * alpha +
+                                                    model->get_normal(face.y) * beta + model->get_normal(face.z) * gamma;
+                }
+            }
+        }
+    });
+}